@@ -57,6 +57,7 @@ __RCSID("$NetBSD: alias.c,v 1.21 2019/02/09 09:11:07 kre Exp $");
 #define ATABSIZE 39
 
 struct alias *atab[ATABSIZE];
+int aliasgen;		/* changed whenever an alias is set or removed */
 
 STATIC void setalias(char *, char *);
 STATIC int by_name(const void *, const void *);
@@ -64,7 +65,6 @@ STATIC void list_aliases(void);
 STATIC int unalias(char *);
 STATIC struct alias **freealias(struct alias **, int);
 STATIC struct alias **hashalias(const char *);
-STATIC int countaliases(void);
 
 STATIC
 void
@@ -82,6 +82,7 @@ setalias(char *name, char *val)
 	ap->val = savestr(val);
 	ap->next = *app;
 	*app = ap;
+	aliasgen++;
 	INTON;
 }
 
@@ -102,6 +103,7 @@ freealias(struct alias **app, int force)
 	 *
 	 * Unless we want to simply free everything (INIT)
 	 */
+	aliasgen++;
 	if (ap->flag & ALIASINUSE && !force) {
 		*ap->name = '\0';
 		return &ap->next;
@@ -231,7 +233,7 @@ list_aliases(void)
  * Use this opportunity to clean up any of those
  * zombies that are no longer needed.
  */
-STATIC int
+int
 countaliases(void)
 {
 	struct alias *ap, **app;
@@ -43,6 +43,9 @@ struct alias {
 	int flag;
 };
 
+extern int aliasgen;
+
 struct alias *lookupalias(const char *, int);
 const char *alias_text(void *, const char *);
 void rmaliases(int);
+int countaliases(void);
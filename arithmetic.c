@@ -60,6 +60,7 @@ __RCSID("$NetBSD: arithmetic.c,v 1.5 2018/04/21 23:01:29 kre Exp $");
 #include "var.h"
 #include "show.h"
 #include "syntax.h"
+#include "mystring.h"
 
 #if ARITH_BOR + ARITH_ASS_GAP != ARITH_BORASS || \
 	ARITH_ASS + ARITH_ASS_GAP != ARITH_EQ
@@ -107,39 +108,6 @@ arith_err(const char *s)
 	/* NOTREACHED */
 }
 
-static intmax_t
-arith_lookupvarint(char *varname)
-{
-	const char *str;
-	char *p;
-	intmax_t result;
-	const int oln = line_number;
-
-	VTRACE(DBG_ARITH, ("Arith var lookup(\"%s\") with lno=%d\n", varname,
-	    arith_var_lno));
-
-	line_number = arith_var_lno;
-	str = lookupvar(varname);
-	line_number = oln;
-
-	if (uflag && str == NULL)
-		arith_err("variable not set");
-	if (str == NULL || *str == '\0')
-		str = "0";
-	errno = 0;
-	result = strtoimax(str, &p, 0);
-	if (errno != 0 || *p != '\0') {
-		if (errno == 0) {
-			while (*p != '\0' && is_space(*p))
-				p++;
-			if (*p == '\0')
-				return result;
-		}
-		arith_err("variable contains non-numeric value");
-	}
-	return result;
-}
-
 static inline int
 arith_prec(int op)
 {
@@ -200,170 +168,289 @@ do_binop(int op, intmax_t a, intmax_t b)
 	}
 }
 
-static intmax_t assignment(int, int);
-static intmax_t comma_list(int, int);
+/*
+ * An expression is compiled, the first time it is seen, into a program
+ * for a little stack machine, which is kept (keyed by the expression
+ * text) so that an expression evaluated over and over, as in a loop,
+ * is only parsed once.  The parser below is the one which used to
+ * evaluate the expression as it went; now it emits code instead, and
+ * what it used to skip with "noeval" is jumped over at run time.
+ *
+ * Variables used by a program are listed in a table of their own, and
+ * each is looked up by name only until its struct var has been found.
+ */
 
-static intmax_t
-primary(int token, union a_token_val *val, int op, int noeval)
+#define	AI_END		0	/* done, the result is on top */
+#define	AI_NUM		1	/* push val */
+#define	AI_VAR		2	/* push var arg */
+#define	AI_PREINC	3	/* add delta to var arg, push the new value */
+#define	AI_POSTINC	4	/* add delta to var arg, push the old value */
+#define	AI_NEG		5	/* top = -top */
+#define	AI_NOT		6	/* top = !top */
+#define	AI_BNOT		7	/* top = ~top */
+#define	AI_BOOL		8	/* top = !!top */
+#define	AI_BINOP	9	/* pop b, top = top <op> b */
+#define	AI_ASSIGN	10	/* var arg = top */
+#define	AI_OPASSIGN	11	/* top = var arg = var arg <op> top */
+#define	AI_POP		12	/* discard top */
+#define	AI_ANDJ		13	/* if top == 0, jump to arg, else pop */
+#define	AI_ORJ		14	/* if top != 0, top = 1 and jump, else pop */
+#define	AI_JZ		15	/* pop, and jump to arg if it was 0 */
+#define	AI_JMP		16	/* jump to arg */
+
+/* how much each op changes the depth of the stack (when not jumping) */
+static const signed char ai_depth[] = {
+	0, 1, 1, 1, 1, 0, 0, 0, 0, -1, 0, 0, -1, -1, -1, -1, -1
+};
+
+struct a_insn {
+	short op;		/* AI_* */
+	short delta;		/* AI_BINOP, AI_OPASSIGN: the operator (token),
+				   AI_PREINC, AI_POSTINC: 1 or -1 */
+	int arg;		/* var number, or jump target */
+	intmax_t val;		/* AI_NUM: the constant, for ops using a
+				   var: the newlines before its name */
+};
+
+struct a_varref {
+	char *name;
+	struct var *vp;		/* the var, once it has been found */
+	unsigned int gen;	/* vargen when vp was found */
+};
+
+struct arith_prog {
+	int depth;		/* most values ever on the stack */
+	int nls;		/* newlines to subtract from lno, if
+				   LINENO might be referenced, else 0 */
+	int nvars;
+	struct a_varref *vars;
+	struct a_insn code[1];
+};
+
+#define	ARITHCACHESIZE	32	/* must be a power of 2 */
+
+static struct arithcache {
+	char *text;		/* the expression, in the same block as prog */
+	unsigned int hash;
+	struct arith_prog *prog;
+} arithcache[ARITHCACHESIZE];
+
+/* the program being compiled */
+static struct a_insn *a_code;
+static int a_ncode;
+static int a_depth, a_maxdepth;
+static struct a_varref *a_vars;
+static int a_nvars;
+
+static int
+emit(int op, int delta, int arg)
 {
-	intmax_t result;
-	char sresult[DIGITS(result) + 1];
+	struct a_insn *ip = &a_code[a_ncode];
+
+	ip->op = op;
+	ip->delta = delta;
+	ip->arg = arg;
+	ip->val = arith_var_lno;
+	a_depth += ai_depth[op];
+	if (a_depth > a_maxdepth)
+		a_maxdepth = a_depth;
+	return a_ncode++;
+}
+
+static void
+emitnum(intmax_t val)
+{
+	int i = emit(AI_NUM, 0, 0);
 
-	VTRACE(DBG_ARITH, ("Arith primary: token %d op %d%s\n",
-	    token, op, noeval ? " noeval" : ""));
+	a_code[i].val = val;
+}
+
+static inline void
+patch(int i)
+{
+
+	a_code[i].arg = a_ncode;
+}
+
+static int
+varslot(char *name)
+{
+	int i;
+
+	for (i = 0; i < a_nvars; i++)
+		if (strcmp(a_vars[i].name, name) == 0)
+			return i;
+	a_vars[i].name = name;
+	a_vars[i].vp = NULL;
+	a_vars[i].gen = 0;
+	return a_nvars++;
+}
+
+static void assignment(int);
+static void comma_list(int);
+
+static void
+primary(int token, union a_token_val *val, int op)
+{
+	char *name;
+
+	VTRACE(DBG_ARITH, ("Arith primary: token %d op %d\n", token, op));
 
 	switch (token) {
 	case ARITH_LPAREN:
-		result = comma_list(op, noeval);
+		comma_list(op);
 		if (last_token != ARITH_RPAREN)
 			arith_err("expecting ')'");
 		last_token = arith_token();
-		return result;
+		return;
 	case ARITH_NUM:
 		last_token = op;
-		return val->val;
+		emitnum(val->val);
+		return;
 	case ARITH_VAR:
-		result = noeval ? val->val : arith_lookupvarint(val->name);
 		if (op == ARITH_INCR || op == ARITH_DECR) {
 			last_token = arith_token();
-			if (noeval)
-				return val->val;
-
-			snprintf(sresult, sizeof(sresult), ARITH_FORMAT_STR,
-			    result + (op == ARITH_INCR ? 1 : -1));
-			setvar(val->name, sresult, 0);
-		} else
+			emit(AI_POSTINC, op == ARITH_INCR ? 1 : -1,
+			    varslot(val->name));
+		} else {
 			last_token = op;
-		return result;
+			emit(AI_VAR, 0, varslot(val->name));
+		}
+		return;
 	case ARITH_ADD:
 		*val = a_t_val;
-		return primary(op, val, arith_token(), noeval);
+		primary(op, val, arith_token());
+		return;
 	case ARITH_SUB:
 		*val = a_t_val;
-		return -primary(op, val, arith_token(), noeval);
+		primary(op, val, arith_token());
+		emit(AI_NEG, 0, 0);
+		return;
 	case ARITH_NOT:
 		*val = a_t_val;
-		return !primary(op, val, arith_token(), noeval);
+		primary(op, val, arith_token());
+		emit(AI_NOT, 0, 0);
+		return;
 	case ARITH_BNOT:
 		*val = a_t_val;
-		return ~primary(op, val, arith_token(), noeval);
+		primary(op, val, arith_token());
+		emit(AI_BNOT, 0, 0);
+		return;
 	case ARITH_INCR:
 	case ARITH_DECR:
 		if (op != ARITH_VAR)
 			arith_err("incr/decr require var name");
+		name = a_t_val.name;
 		last_token = arith_token();
-		if (noeval)
-			return val->val;
-		result = arith_lookupvarint(a_t_val.name);
-		snprintf(sresult, sizeof(sresult), ARITH_FORMAT_STR,
-			    result += (token == ARITH_INCR ? 1 : -1));
-		setvar(a_t_val.name, sresult, 0);
-		return result;
+		emit(AI_PREINC, token == ARITH_INCR ? 1 : -1, varslot(name));
+		return;
 	default:
 		arith_err("expecting primary");
 	}
-	return 0;	/* never reached */
 }
 
-static intmax_t
-binop2(intmax_t a, int op, int precedence, int noeval)
+static void
+binop2(int op, int precedence)
 {
 	union a_token_val val;
-	intmax_t b;
 	int op2;
 	int token;
 
-	VTRACE(DBG_ARITH, ("Arith: binop2 %jd op %d (P:%d)%s\n",
-	    a, op, precedence, noeval ? " noeval" : ""));
+	VTRACE(DBG_ARITH, ("Arith: binop2 op %d (P:%d)\n", op, precedence));
 
 	for (;;) {
 		token = arith_token();
 		val = a_t_val;
 
-		b = primary(token, &val, arith_token(), noeval);
+		primary(token, &val, arith_token());
 
 		op2 = last_token;
 		if (op2 >= ARITH_BINOP_MIN && op2 < ARITH_BINOP_MAX &&
 		    higher_prec(op2, op)) {
-			b = binop2(b, op2, arith_prec(op), noeval);
+			binop2(op2, arith_prec(op));
 			op2 = last_token;
 		}
 
-		a = noeval ? b : do_binop(op, a, b);
+		emit(AI_BINOP, op, 0);
 
 		if (op2 < ARITH_BINOP_MIN || op2 >= ARITH_BINOP_MAX ||
 		    arith_prec(op2) >= precedence)
-			return a;
+			return;
 
 		op = op2;
 	}
 }
 
-static intmax_t
-binop(int token, union a_token_val *val, int op, int noeval)
+static void
+binop(int token, union a_token_val *val, int op)
 {
-	intmax_t a = primary(token, val, op, noeval);
+	primary(token, val, op);
 
 	op = last_token;
 	if (op < ARITH_BINOP_MIN || op >= ARITH_BINOP_MAX)
-		return a;
+		return;
 
-	return binop2(a, op, ARITH_MAX_PREC, noeval);
+	binop2(op, ARITH_MAX_PREC);
 }
 
-static intmax_t
-and(int token, union a_token_val *val, int op, int noeval)
+static void
+and(int token, union a_token_val *val, int op)
 {
-	intmax_t a = binop(token, val, op, noeval);
-	intmax_t b;
+	int j;
+
+	binop(token, val, op);
 
 	op = last_token;
 	if (op != ARITH_AND)
-		return a;
+		return;
 
-	VTRACE(DBG_ARITH, ("Arith: AND %jd%s\n", a, noeval ? " noeval" : ""));
+	VTRACE(DBG_ARITH, ("Arith: AND\n"));
 
 	token = arith_token();
 	*val = a_t_val;
 
-	b = and(token, val, arith_token(), noeval | !a);
-
-	return a && b;
+	j = emit(AI_ANDJ, 0, 0);
+	and(token, val, arith_token());
+	emit(AI_BOOL, 0, 0);
+	patch(j);
 }
 
-static intmax_t
-or(int token, union a_token_val *val, int op, int noeval)
+static void
+or(int token, union a_token_val *val, int op)
 {
-	intmax_t a = and(token, val, op, noeval);
-	intmax_t b;
+	int j;
+
+	and(token, val, op);
 
 	op = last_token;
 	if (op != ARITH_OR)
-		return a;
+		return;
 
-	VTRACE(DBG_ARITH, ("Arith: OR %jd%s\n", a, noeval ? " noeval" : ""));
+	VTRACE(DBG_ARITH, ("Arith: OR\n"));
 
 	token = arith_token();
 	*val = a_t_val;
 
-	b = or(token, val, arith_token(), noeval | !!a);
-
-	return a || b;
+	j = emit(AI_ORJ, 0, 0);
+	or(token, val, arith_token());
+	emit(AI_BOOL, 0, 0);
+	patch(j);
 }
 
-static intmax_t
-cond(int token, union a_token_val *val, int op, int noeval)
+static void
+cond(int token, union a_token_val *val, int op)
 {
-	intmax_t a = or(token, val, op, noeval);
-	intmax_t b;
-	intmax_t c;
+	int jz, jmp;
+
+	or(token, val, op);
 
 	if (last_token != ARITH_QMARK)
-		return a;
+		return;
 
-	VTRACE(DBG_ARITH, ("Arith: ?: %jd%s\n", a, noeval ? " noeval" : ""));
+	VTRACE(DBG_ARITH, ("Arith: ?:\n"));
 
-	b = assignment(arith_token(), noeval | !a);
+	jz = emit(AI_JZ, 0, 0);
+	assignment(arith_token());
 
 	if (last_token != ARITH_COLON)
 		arith_err("expecting ':'");
@@ -371,91 +458,294 @@ cond(int token, union a_token_val *val, int op, int noeval)
 	token = arith_token();
 	*val = a_t_val;
 
-	c = cond(token, val, arith_token(), noeval | !!a);
-
-	return a ? b : c;
+	jmp = emit(AI_JMP, 0, 0);
+	patch(jz);
+	cond(token, val, arith_token());
+	patch(jmp);
 }
 
-static intmax_t
-assignment(int var, int noeval)
+static void
+assignment(int var)
 {
 	union a_token_val val = a_t_val;
 	int op = arith_token();
-	intmax_t result;
-	char sresult[DIGITS(result) + 1];
-
 
-	if (var != ARITH_VAR)
-		return cond(var, &val, op, noeval);
+	if (var != ARITH_VAR) {
+		cond(var, &val, op);
+		return;
+	}
 
-	if (op != ARITH_ASS && (op < ARITH_ASS_MIN || op >= ARITH_ASS_MAX))
-		return cond(var, &val, op, noeval);
+	if (op != ARITH_ASS && (op < ARITH_ASS_MIN || op >= ARITH_ASS_MAX)) {
+		cond(var, &val, op);
+		return;
+	}
 
-	VTRACE(DBG_ARITH, ("Arith: %s ASSIGN %d%s\n", val.name, op,
-	    noeval ? " noeval" : ""));
+	VTRACE(DBG_ARITH, ("Arith: %s ASSIGN %d\n", val.name, op));
 
-	result = assignment(arith_token(), noeval);
-	if (noeval)
-		return result;
+	assignment(arith_token());
 
-	if (op != ARITH_ASS)
-		result = do_binop(op - ARITH_ASS_GAP,
-		    arith_lookupvarint(val.name), result);
-	snprintf(sresult, sizeof(sresult), ARITH_FORMAT_STR, result);
-	setvar(val.name, sresult, 0);
-	return result;
+	if (op == ARITH_ASS)
+		emit(AI_ASSIGN, 0, varslot(val.name));
+	else
+		emit(AI_OPASSIGN, op - ARITH_ASS_GAP, varslot(val.name));
 }
 
-static intmax_t
-comma_list(int token, int noeval)
+static void
+comma_list(int token)
 {
-	intmax_t result = assignment(token, noeval);
+	assignment(token);
 
 	while (last_token == ARITH_COMMA) {
-		VTRACE(DBG_ARITH, ("Arith: comma discarding %jd%s\n", result,
-		    noeval ? " noeval" : ""));
-		result = assignment(arith_token(), noeval);
+		VTRACE(DBG_ARITH, ("Arith: comma\n"));
+		emit(AI_POP, 0, 0);
+		assignment(arith_token());
 	}
-
-	return result;
 }
 
-intmax_t
-arith(const char *s, int lno)
+/*
+ * Compile the expression s (which is hash) and enter the result in
+ * the cache.
+ */
+static struct arith_prog *
+arith_compile(const char *s, unsigned int hash, int len)
 {
-	struct stackmark smark;
-	intmax_t result;
+	struct arithcache *ac;
+	struct arith_prog *ap;
 	const char *p;
-	int nls = 0;
-
-	setstackmark(&smark);
-
-	arith_lno = lno;
-
-	CTRACE(DBG_ARITH, ("Arith(\"%s\", %d) @%d\n", s, lno, arith_lno));
+	char *q;
+	int i, nls, size, len2;
+
+	/*
+	 * Each token emits at most two instructions, and there are
+	 * no more tokens (or vars) than there are chars.
+	 */
+	a_code = stalloc((2 * len + 2) * sizeof(*a_code));
+	a_vars = stalloc((len + 1) * sizeof(*a_vars));
+	a_ncode = a_nvars = 0;
+	a_depth = a_maxdepth = 0;
 
 	/* check if it is possible we might reference LINENO */
+	nls = 0;
 	p = s;
 	while ((p = strchr(p, 'L')) != NULL) {
 		if (p[1] == 'I' && p[2] == 'N') {
-			/* if it is possible, we need to correct airth_lno */
+			/* if it is possible, we need to correct line numbers */
 			p = s;
 			while ((p = strchr(p, '\n')) != NULL)
 				nls++, p++;
 			VTRACE(DBG_ARITH, ("Arith found %d newlines\n", nls));
-			arith_lno -= nls;
 			break;
 		}
 		p++;
 	}
 
-	arith_buf = arith_startbuf = s;
+	arith_buf = s;
+	arith_lno = arith_var_lno = 0;
 
-	result = comma_list(arith_token(), 0);
+	comma_list(arith_token());
 
 	if (last_token)
 		arith_err("expecting end of expression");
 
+	emit(AI_END, 0, 0);
+
+	/*
+	 * Put it all (the expression text too) in one block.
+	 */
+	size = sizeof(*ap) + (a_ncode - 1) * sizeof(*a_code) +
+	    a_nvars * sizeof(*a_vars);
+	for (i = 0; i < a_nvars; i++)
+		size += strlen(a_vars[i].name) + 1;
+	size += len + 1;
+
+	INTOFF;
+	ap = ckmalloc(size);
+	ap->depth = a_maxdepth;
+	ap->nls = nls;
+	ap->nvars = a_nvars;
+	memcpy(ap->code, a_code, a_ncode * sizeof(*a_code));
+	ap->vars = (struct a_varref *)&ap->code[a_ncode];
+	q = (char *)&ap->vars[a_nvars];
+	for (i = 0; i < a_nvars; i++) {
+		ap->vars[i] = a_vars[i];
+		ap->vars[i].name = q;
+		len2 = strlen(a_vars[i].name) + 1;
+		memcpy(q, a_vars[i].name, len2);
+		q += len2;
+	}
+	memcpy(q, s, len + 1);
+
+	ac = &arithcache[hash & (ARITHCACHESIZE - 1)];
+	if (ac->prog != NULL)
+		ckfree(ac->prog);
+	ac->text = q;
+	ac->hash = hash;
+	ac->prog = ap;
+	INTON;
+
+	return ap;
+}
+
+static intmax_t
+arith_getvar(struct a_varref *vr, int lno)
+{
+	const char *str;
+	char *p;
+	intmax_t result;
+	const int oln = line_number;
+
+	VTRACE(DBG_ARITH, ("Arith var lookup(\"%s\") with lno=%d\n",
+	    vr->name, lno));
+
+	if (vr->vp == NULL || vr->gen != vargen) {
+		vr->vp = findvar(vr->name);
+		vr->gen = vargen;
+	}
+	if (lookupvarint(vr->vp, &result))
+		return result;
+
+	line_number = lno;
+	str = lookupvp(vr->vp);
+	line_number = oln;
+
+	if (uflag && str == NULL)
+		arith_err("variable not set");
+	if (str == NULL || *str == '\0')
+		str = "0";
+	errno = 0;
+	result = strtoimax(str, &p, 0);
+	if (errno != 0 || *p != '\0') {
+		if (errno == 0) {
+			while (*p != '\0' && is_space(*p))
+				p++;
+			if (*p == '\0')
+				goto out;
+		}
+		arith_err("variable contains non-numeric value");
+	}
+ out:
+	savevarint(vr->vp, result);
+	return result;
+}
+
+static void
+arith_setvar(struct a_varref *vr, intmax_t val)
+{
+
+	if (vr->vp != NULL && vr->gen != vargen)
+		vr->vp = NULL;
+	setvarint(vr->name, vr->vp, val);
+}
+
+static intmax_t
+arith_run(struct arith_prog *ap, int lno)
+{
+	struct a_insn *ip;
+	struct a_varref *vr;
+	intmax_t *stack, *sp;
+	intmax_t result;
+
+	lno -= ap->nls;
+	stack = stalloc(ap->depth * sizeof(*stack));
+	sp = stack;
+
+	for (ip = ap->code;; ip++) {
+		vr = ip->op <= AI_OPASSIGN ? &ap->vars[ip->arg] : NULL;
+		switch (ip->op) {
+		case AI_END:
+			return sp[-1];
+		case AI_NUM:
+			*sp++ = ip->val;
+			break;
+		case AI_VAR:
+			*sp++ = arith_getvar(vr, lno + ip->val);
+			break;
+		case AI_PREINC:
+			result = arith_getvar(vr, lno + ip->val) + ip->delta;
+			arith_setvar(vr, result);
+			*sp++ = result;
+			break;
+		case AI_POSTINC:
+			result = arith_getvar(vr, lno + ip->val);
+			arith_setvar(vr, result + ip->delta);
+			*sp++ = result;
+			break;
+		case AI_NEG:
+			sp[-1] = -sp[-1];
+			break;
+		case AI_NOT:
+			sp[-1] = !sp[-1];
+			break;
+		case AI_BNOT:
+			sp[-1] = ~sp[-1];
+			break;
+		case AI_BOOL:
+			sp[-1] = sp[-1] != 0;
+			break;
+		case AI_BINOP:
+			sp--;
+			sp[-1] = do_binop(ip->delta, sp[-1], sp[0]);
+			break;
+		case AI_ASSIGN:
+			arith_setvar(vr, sp[-1]);
+			break;
+		case AI_OPASSIGN:
+			sp[-1] = do_binop(ip->delta,
+			    arith_getvar(vr, lno + ip->val), sp[-1]);
+			arith_setvar(vr, sp[-1]);
+			break;
+		case AI_POP:
+			sp--;
+			break;
+		case AI_ANDJ:
+			if (sp[-1] == 0)
+				ip = &ap->code[ip->arg - 1];
+			else
+				sp--;
+			break;
+		case AI_ORJ:
+			if (sp[-1] != 0) {
+				sp[-1] = 1;
+				ip = &ap->code[ip->arg - 1];
+			} else
+				sp--;
+			break;
+		case AI_JZ:
+			if (*--sp == 0)
+				ip = &ap->code[ip->arg - 1];
+			break;
+		case AI_JMP:
+			ip = &ap->code[ip->arg - 1];
+			break;
+		}
+	}
+}
+
+intmax_t
+arith(const char *s, int lno)
+{
+	struct stackmark smark;
+	struct arithcache *ac;
+	struct arith_prog *ap;
+	intmax_t result;
+	unsigned int hash;
+	int len;
+
+	setstackmark(&smark);
+
+	CTRACE(DBG_ARITH, ("Arith(\"%s\", %d)\n", s, lno));
+
+	arith_startbuf = s;
+
+	hash = strhash(s, '\0', &len);
+	ac = &arithcache[hash & (ARITHCACHESIZE - 1)];
+	if (ac->prog != NULL && ac->hash == hash && strcmp(ac->text, s) == 0)
+		ap = ac->prog;
+	else
+		ap = arith_compile(s, hash, len);
+
+	result = arith_run(ap, lno);
+
 	popstackmark(&smark);
 
 	CTRACE(DBG_ARITH, ("Arith result=%jd\n", result));
@@ -42,6 +42,8 @@ __RCSID("$NetBSD: eval.c,v 1.178 2020/02/04 16:06:59 kre Exp $");
 #endif /* not lint */
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <signal.h>
 #include <stdio.h>
@@ -50,8 +52,11 @@ __RCSID("$NetBSD: eval.c,v 1.178 2020/02/04 16:06:59 kre Exp $");
 #include <limits.h>
 #include <unistd.h>
 #include <sys/fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/times.h>
+#include <sys/resource.h>
+#include <time.h>
 #include <sys/param.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -81,6 +86,7 @@ __RCSID("$NetBSD: eval.c,v 1.178 2020/02/04 16:06:59 kre Exp $");
 #include "show.h"
 #include "mystring.h"
 #include "main.h"
+#include "alias.h"
 #ifndef SMALL
 #include "nodenames.h"
 #include "myhistedit.h"
@@ -94,6 +100,15 @@ STATIC struct skipsave s_k_i_p;
 STATIC int loopnest;		/* current loop nesting level */
 STATIC int funcnest;		/* depth of function calls */
 STATIC int builtin_flags;	/* evalcommand flags for builtins */
+
+/* how evalcommand() is to connect a member of a pipeline (EV_PIPE) */
+struct pipecmd {
+	struct job *jp;		/* the job for the pipeline */
+	int mode;		/* FORK_FG or FORK_BG */
+	int in;			/* fd to become stdin, or -1 */
+	int out;		/* fd to become stdout, or -1 */
+	int outrd;		/* the other end of the out pipe */
+};
 /*
  * Base function nesting level inside a dot command.  Set to 0 initially
  * and to (funcnest + 1) before every dot command to enable 
@@ -117,12 +132,180 @@ STATIC void evalcase(union node *, int);
 STATIC void evalsubshell(union node *, int);
 STATIC void expredir(union node *);
 STATIC void evalredir(union node *, int);
-STATIC void evalpipe(union node *);
-STATIC void evalcommand(union node *, int, struct backcmd *);
+STATIC void evalpipe(union node *, int);
+STATIC void evallastpipe(union node *, int, int);
+STATIC void evalcommand(union node *, int, struct backcmd *,
+    struct pipecmd *);
+STATIC void evalbackcmd_nofork(union node *, struct backcmd *);
+STATIC int safe_backcmd(const struct cmdentry *, int, char **,
+    const union node *);
+STATIC void evalpipe_nofork(union node *, struct pipecmd *);
+STATIC int safe_pipecmd(union node *);
 STATIC void prehash(union node *);
 
 STATIC char *find_dot_file(char *);
 
+/*
+ * Commands parsed from files read by "." and from strings run by eval
+ * are kept, so that when the same file, or string, is run again it
+ * need not be parsed again.  A file is known by its device, inode,
+ * size, and modification and status change times (which catches a
+ * rewrite that puts the old modification time back), a string by its
+ * text and the line on which it starts (which is in the trees).  What
+ * the parser makes of the text also depends upon the aliases and the
+ * posix option, so those must not have changed either.
+ *
+ * A file modified in the last couple of seconds is not kept, as where
+ * the file system keeps only whole seconds, a later change in the same
+ * second would not be noticed.  A string is
+ * kept only the second time it is seen, so that strings made up anew
+ * each time do not push everything else out.  At most TCMAX entries
+ * are kept, the least recently used is dropped when there are more.
+ *
+ * The trees for a file can also be kept from one shell to the next, as
+ * an image (see nodeimage()) written to a file in the PARSECACHEDIR
+ * directory, which a later shell maps back in (if the file is still
+ * the same).  As nothing can be known of the aliases some other shell
+ * will have, an image is made, and used, only when there are none.
+ */
+
+#define	TCMAX		32
+#define	TCSEEN		64	/* must be a power of 2 */
+#define	TCMAGIC		"ashtrees"
+#define	TCFORMAT	3		/* of struct tcimage, and the rest */
+#define	TCVERSION	(NODELAYOUT ^ TCFORMAT)
+#define	TCIMAGEMAX	(16 * 1024 * 1024)
+
+struct tcentry {
+	struct tcentry *next;		/* next less recently used */
+	unsigned int refcount;		/* the cache, plus each user */
+	int isfile;			/* from ".", else from eval */
+	dev_t dev;			/* file: */
+	ino_t ino;
+	struct timespec mtime;
+	struct timespec ctime;
+	off_t size;
+	unsigned int hash;		/* eval: hash of the string */
+	int lno;			/* eval: the line it starts on */
+	int aliasgen;			/* aliasgen when parsed */
+	int posixopt;			/* the posix option when parsed */
+	int ntree;
+	int lasteof;			/* eval: the tree at_eof() was after */
+	unsigned long hits;
+	union node **node;		/* the trees */
+	struct funcdef **tree;		/* their copies, if parsed here */
+	pointer image;			/* or the image they are in */
+	size_t imagesize;
+	char text[1];			/* the file name, or the string */
+};
+
+/* the start of an image file */
+struct tcimage {
+	char magic[8];			/* TCMAGIC */
+	unsigned int version;		/* TCVERSION */
+	unsigned int sum;		/* tcsum() of the image, with this 0 */
+	int ptrsize;			/* sizeof(pointer), to be sure */
+	int nodesize;			/* sizeof(union node), likewise */
+	int posixopt;			/* the posix option when parsed */
+	dev_t dev;			/* the file it was made from */
+	ino_t ino;
+	struct timespec mtime;
+	struct timespec ctime;
+	off_t size;
+	size_t imagesize;		/* size of the whole image */
+	int ntree;
+	size_t offs[1];			/* offsets of the ntree trees */
+};
+
+#define	TCIMAGEHDR(ntree)	(offsetof(struct tcimage, offs) + \
+				    (ntree) * sizeof(size_t))
+
+STATIC struct tcentry *tclist;
+STATIC int ntclist;
+STATIC unsigned int tcseen[TCSEEN];
+
+STATIC struct tcentry *tclookup(int, const struct stat *, const char *,
+    unsigned int, int);
+STATIC struct tcentry *tcnew(int, const struct stat *, const char *,
+    unsigned int, int);
+STATIC void tcaddtree(struct tcentry *, union node *);
+STATIC void tcenter(struct tcentry *);
+STATIC void tcrelease(struct tcentry *);
+STATIC void tcremove(struct tcentry *);
+STATIC char *tcimagepath(dev_t, ino_t);
+STATIC unsigned int tcsum(const void *, size_t);
+STATIC struct tcentry *tcload(const struct stat *, const char *);
+STATIC void tcsave(struct tcentry *);
+STATIC void dotloop(struct tcentry *);
+STATIC void dotreplay(struct tcentry *);
+
+#ifndef SMALL
+/*
+ * The profiler ("profile -b").  Each simple command, pipeline and
+ * subshell evaluated is a frame on profstack, timed from when its
+ * evaluation starts (before its words are expanded) until it is done,
+ * for wall clock time, user and system time (including that of the
+ * children waited for meanwhile), processes forked and external
+ * commands run.  What is left after taking out the frames nested in
+ * it is charged to its line (in the function it is in) and to its
+ * folded stack, its whole time to the function or external command
+ * it ran.  A frame abandoned by an exception is dropped when the one
+ * it is nested in finishes.
+ */
+
+struct proftimes {
+	uint64_t wall;			/* all in microseconds */
+	uint64_t user;
+	uint64_t sys;
+	unsigned long forks;
+	unsigned long execs;
+};
+
+struct profframe {
+	const char *name;		/* what it ran, once that is known */
+	int cmdtype;			/* CMDFUNCTION ..., or -1 */
+	int line;
+	int func;			/* frame of the function it is in, or -1 */
+	struct proftimes start;
+	struct proftimes inner;		/* the frames nested in it */
+};
+
+#define	PE_LINE		0		/* kinds of profent */
+#define	PE_FUNC		1
+#define	PE_CMD		2		/* external command */
+#define	PE_STACK	3		/* folded stack, for flame graphs */
+
+struct profent {
+	struct profent *next;		/* in its hash chain */
+	unsigned int hash;
+	int kind;			/* PE_* */
+	int line;			/* PE_LINE */
+	unsigned long count;
+	struct proftimes t;
+	char name[1];			/* function (PE_LINE), or what it is */
+};
+
+int profiling;
+STATIC struct profframe *profstack;
+STATIC int profdepth;
+STATIC int profmax;
+STATIC struct profent **proftab;
+STATIC int proftabsize;			/* a power of 2, or 0 */
+STATIC int nprofent;
+STATIC unsigned long profexecs;
+
+STATIC int profpush(const char *, int);
+STATIC void profpop(int);
+STATIC void profsample(struct proftimes *);
+STATIC void profdiff(struct proftimes *, const struct proftimes *,
+    const struct proftimes *);
+STATIC void profsum(struct proftimes *, const struct proftimes *);
+STATIC void profadd(int, const char *, int, const struct proftimes *);
+STATIC void profclear(void);
+STATIC int profline(union node *);
+STATIC void profreport(int, const char *, int);
+#endif
+
 /*
  * Called to reset things after an exception.
  */
@@ -146,6 +329,9 @@ reset_eval(void)
 	dot_funcnest = 0;
 	loopnest = 0;
 	funcnest = 0;
+#ifndef SMALL
+	profdepth = 0;
+#endif
 }
 
 static int
@@ -217,18 +403,73 @@ evalstring(char *s, int flag)
 {
 	union node *n;
 	struct stackmark smark;
+	struct jmploc jmploc;
+	struct jmploc *const savehandler = handler;
+	struct tcentry *volatile tc = NULL;
+	unsigned int hash;
+	volatile int replay = 0;
 	int last;
 	int any;
+	int len, i;
 
 	last = flag & EV_EXIT;
 	flag &= ~EV_EXIT;
 
 	setstackmark(&smark);
+
+	if (vflag)
+		hash = 0;
+	else {
+		hash = strhash(s, '\0', &len);
+		tc = tclookup(0, NULL, s, hash, line_number);
+		replay = tc != NULL;
+	}
+	if (tc == NULL && !vflag) {
+		i = hash & (TCSEEN - 1);
+		if (tcseen[i] == hash)
+			tc = tcnew(0, NULL, s, hash, line_number);
+		else
+			tcseen[i] = hash;
+	}
+	if (tc != NULL) {
+		if (setjmp(jmploc.loc)) {
+			tcrelease(tc);
+			handler = savehandler;
+			longjmp(handler->loc, 1);
+		}
+		handler = &jmploc;
+	}
+
+	if (replay) {
+		/* run the trees kept from last time */
+		any = 0;
+		for (i = 0; i < tc->ntree; i++) {
+			n = tc->node[i];
+			XTRACE(DBG_EVAL, ("evalstring(cached): "), showtree(n));
+			if (nflag == 0) {
+				if (last && i == tc->lasteof)
+					evaltree(n, flag | EV_EXIT);
+				else
+					evaltree(n, flag);
+				any = 1;
+				if (evalskip)
+					break;
+			}
+			rststackmark(&smark);
+		}
+		goto out;
+	}
+
 	setinputstring(s, 1, line_number);
 
 	any = 0;	/* to determine if exitstatus will have been set */
 	while ((n = parsecmd(0)) != NEOF) {
 		XTRACE(DBG_EVAL, ("evalstring: "), showtree(n));
+		if (n && tc != NULL) {
+			tcaddtree(tc, n);
+			if (at_eof())
+				tc->lasteof = tc->ntree - 1;
+		}
 		if (n && nflag == 0) {
 			if (last && at_eof())
 				evaltree(n, flag | EV_EXIT);
@@ -240,7 +481,14 @@ evalstring(char *s, int flag)
 		}
 		rststackmark(&smark);
 	}
+	if (tc != NULL && n == NEOF)
+		tcenter(tc);
 	popfile();
+ out:
+	if (tc != NULL) {
+		handler = savehandler;
+		tcrelease(tc);
+	}
 	popstackmark(&smark);
 	if (!any)
 		exitstatus = 0;
@@ -262,6 +510,9 @@ evaltree(union node *n, int flags)
 	int sflags = flags & ~EV_EXIT;
 	union node *next;
 	struct stackmark smark;
+#ifndef SMALL
+	int pf;
+#endif
 
 	do_etest = false;
 	if (n == NULL || nflag) {
@@ -282,6 +533,13 @@ evaltree(union node *n, int flags)
 		    getpid(), n, NODETYPENAME(n->type), n->type, flags));
 		if (n->type != NCMD && traps_invalid)
 			free_traps();
+#ifndef SMALL
+		pf = -1;
+		if (profiling && (n->type == NPIPE || n->type == NSUBSHELL ||
+		    n->type == NBACKGND))
+			pf = profpush(n->type == NPIPE ? "(pipeline)" :
+			    "(subshell)", profline(n));
+#endif
 		switch (n->type) {
 		case NSEMI:
 			evaltree(n->nbinary.ch1, sflags);
@@ -350,11 +608,11 @@ evaltree(union node *n, int flags)
 				exitstatus = 1;
 			break;
 		case NPIPE:
-			evalpipe(n);
+			evalpipe(n, flags);
 			do_etest = !(flags & EV_TESTED);
 			break;
 		case NCMD:
-			evalcommand(n, flags, NULL);
+			evalcommand(n, flags, NULL, NULL);
 			do_etest = !(flags & EV_TESTED);
 			break;
 		default:
@@ -367,6 +625,10 @@ evaltree(union node *n, int flags)
 			flushout(&output);
 			break;
 		}
+#ifndef SMALL
+		if (pf >= 0)
+			profpop(pf);
+#endif
 		n = next;
 		rststackmark(&smark);
 	} while(n != NULL);
@@ -674,32 +936,52 @@ evalredir(union node *n, int flags)
  */
 
 STATIC void
-evalpipe(union node *n)
+evalpipe(union node *n, int flags)
 {
 	struct job *jp;
 	struct nodelist *lp;
+	struct nodelist *volatile lastp;
 	int pipelen;
 	int prevfd;
 	int pip[2];
+	struct pipecmd pc;
+	struct jmploc jmploc;
+	struct jmploc *volatile savehandler;
+	int pf, status;
 
 	CTRACE(DBG_EVAL, ("evalpipe(%p) called\n", n));
 	pipelen = 0;
-	for (lp = n->npipe.cmdlist ; lp ; lp = lp->next)
+	lastp = NULL;
+	for (lp = n->npipe.cmdlist ; lp ; lp = lp->next) {
 		pipelen++;
+		lastp = lp;
+	}
+	/* lastpipe: the last command is run below, by this shell */
+	if (!lastpipe || mflag || n->npipe.backgnd || pipelen < 2)
+		lastp = NULL;
+	pf = pipefail;
 	INTOFF;
-	jp = makejob(n, pipelen);
+	jp = makejob(n, lastp != NULL ? pipelen - 1 : pipelen);
 	prevfd = -1;
-	for (lp = n->npipe.cmdlist ; lp ; lp = lp->next) {
+	for (lp = n->npipe.cmdlist ; lp != lastp ; lp = lp->next) {
 		prehash(lp->n);
 		pip[1] = -1;
 		if (lp->next) {
 			if (sh_pipe(pip) < 0) {
 				if (prevfd >= 0)
 					close(prevfd);
+				jobtext(jp);
 				error("Pipe call failed: %s", strerror(errno));
 			}
 		}
-		if (forkshell(jp, lp->n,
+		if (safe_pipecmd(lp->n)) {
+			pc.jp = jp;
+			pc.mode = n->npipe.backgnd ? FORK_BG : FORK_FG;
+			pc.in = prevfd;
+			pc.out = pip[1];
+			pc.outrd = pip[0];
+			evalpipe_nofork(lp->n, &pc);
+		} else if (forkshell(jp, lp->n,
 		    n->npipe.backgnd ? FORK_BG : FORK_FG) == 0) {
 			INTON;
 			if (prevfd > 0)
@@ -715,8 +997,31 @@ evalpipe(union node *n)
 		prevfd = pip[0];
 		close(pip[1]);
 	}
+	status = 0;
+	if (lastp != NULL) {
+		jobtext(jp);
+		savehandler = handler;
+		if (setjmp(jmploc.loc)) {
+			/*
+			 * evallastpipe() has closed the pipe, so the
+			 * rest of the pipeline can finish: wait for it,
+			 * so its job goes, as it would without lastpipe.
+			 */
+			handler = savehandler;
+			(void)waitforjob(jp);
+			longjmp(handler->loc, 1);
+		}
+		handler = &jmploc;
+		INTON;
+		evallastpipe(lastp->n, prevfd, flags);
+		status = exitstatus;
+		INTOFF;
+		handler = savehandler;
+	}
 	if (n->npipe.backgnd == 0) {
 		exitstatus = waitforjob(jp);
+		if (lastp != NULL && (!pf || status != 0))
+			exitstatus = status;
 		CTRACE(DBG_EVAL, ("evalpipe:  job done exit status %d\n",
 		    exitstatus));
 	} else
@@ -724,6 +1029,145 @@ evalpipe(union node *n)
 	INTON;
 }
 
+/*
+ * Run the last command of a pipeline (the lastpipe option) in this
+ * shell, with its standard input from fd, the read end of the pipe.
+ */
+
+STATIC void
+evallastpipe(union node *n, int fd, int flags)
+{
+	struct jmploc jmploc;
+	struct jmploc * const savehandler = handler;
+	volatile int pfd = fd;
+	union node redir;
+
+	redir.type = NFROMFD;
+	redir.ndup.next = NULL;
+	redir.ndup.fd = 0;
+	redir.ndup.dupfd = fd;
+	redir.ndup.vname = NULL;
+
+	if (setjmp(jmploc.loc)) {
+		handler = savehandler;
+		if (pfd >= 0)
+			close(pfd);
+		popredir();
+		longjmp(handler->loc, 1);
+	}
+	INTOFF;
+	handler = &jmploc;
+	redirect(&redir, REDIR_PUSH);
+	close(fd);
+	pfd = -1;
+	INTON;
+	evaltree(n, flags & EV_TESTED);
+	INTOFF;
+	handler = savehandler;
+	popredir();
+	INTON;
+}
+
+
+
+/*
+ * A simple command in a pipeline is handed to evalcommand(), so that
+ * its words are expanded here, and it can then be started with vfork()
+ * when it is not a builtin or function.  As with evalbackcmd_nofork(),
+ * all variables assigned are made local, and put back afterwards, and
+ * exitstatus and LINENO are preserved.  An error in the expansions
+ * would end the subshell the command would have had, so a process is
+ * forked just to exit with the status that subshell would have had.
+ */
+
+STATIC void
+evalpipe_nofork(union node *n, struct pipecmd *pc)
+{
+	struct jmploc jmploc;
+	struct jmploc *const savehandler = handler;
+	struct localvar *const savelocalvars = localvars;
+	const int savestatus = exitstatus;
+	const int saveline = line_number;
+	const int saveint = suppressint;
+	const int nprocs = pc->jp->nprocs;
+	volatile int status = 0;
+	int e;
+
+	localvars = NULL;
+	forcelocal++;
+	if (setjmp(jmploc.loc)) {
+		handler = savehandler;
+		e = exception;
+		if (e == EXERROR || e == EXEXEC)
+			status = e == EXEXEC ? exerrno : 2;
+		forcelocal--;
+		poplocalvars();
+		localvars = savelocalvars;
+		line_number = saveline;
+		if (e != EXERROR && e != EXEXEC)
+			longjmp(handler->loc, 1);
+		suppressint = saveint;
+		if (pc->jp->nprocs == nprocs &&
+		    forkshell(pc->jp, n, pc->mode) == 0)
+			_exit(status);
+	} else {
+		handler = &jmploc;
+		evalcommand(n, EV_PIPE, NULL, pc);
+		handler = savehandler;
+		forcelocal--;
+		poplocalvars();
+		localvars = savelocalvars;
+		line_number = saveline;
+	}
+	suppressint = saveint;
+	exitstatus = savestatus;
+}
+
+/*
+ * Whether a member of a pipeline can be given to evalpipe_nofork():
+ * a simple command with no command substitutions, as they would need
+ * to be run with the pipe as their input, or output.  That is worth
+ * doing when the command can be vfork()ed, or when profiling, as only
+ * then does this shell see the command the member runs.
+ */
+
+STATIC int
+safe_pipecmd(union node *n)
+{
+	union node *np, *arg;
+	int want = 0;
+
+#ifdef DO_SHAREDVFORK
+	want = !usefork;
+#endif
+#ifndef SMALL
+	if (profiling)
+		want = 1;
+#endif
+	if (!want || n == NULL || n->type != NCMD || n->ncmd.backgnd)
+		return 0;
+	for (np = n->ncmd.args; np != NULL; np = np->narg.next)
+		if (np->narg.backquote != NULL)
+			return 0;
+	for (np = n->ncmd.redirect; np != NULL; np = np->nfile.next) {
+		switch (np->type) {
+		case NTOFD:
+		case NFROMFD:
+			arg = np->ndup.vname;
+			break;
+		case NHERE:
+		case NXHERE:
+			arg = NULL;	/* expanded in the child */
+			break;
+		default:
+			arg = np->nfile.fname;
+			break;
+		}
+		if (arg != NULL && arg->narg.backquote != NULL)
+			return 0;
+	}
+	return 1;
+}
 
 
 /*
@@ -738,7 +1182,7 @@ evalbackcmd(union node *n, struct backcmd *result)
 {
 	int pip[2];
 	struct job *jp;
-	struct stackmark smark;		/* unnecessary (because we fork) */
+	struct stackmark smark;
 
 	result->fd = -1;
 	result->buf = NULL;
@@ -750,19 +1194,14 @@ evalbackcmd(union node *n, struct backcmd *result)
 
 	setstackmark(&smark);
 
-#ifdef notyet
-	/*
-	 * For now we disable executing builtins in the same
-	 * context as the shell, because we are not keeping
-	 * enough state to recover from changes that are
-	 * supposed only to affect subshells. eg. echo "`cd /`"
-	 */
-	if (n->type == NCMD) {
-		exitstatus = oexitstatus;	/* XXX o... no longer exists */
-		evalcommand(n, EV_BACKCMD, result);
-	} else
-#endif
-	{
+	if (n->type == NCMD && n->ncmd.backgnd == 0) {
+		/*
+		 * A simple command is handed to evalcommand(), which
+		 * runs it here if it is a builtin that is safe to run
+		 * without a subshell, and forks otherwise.
+		 */
+		evalbackcmd_nofork(n, result);
+	} else {
 		INTOFF;
 		if (sh_pipe(pip) < 0)
 			error("Pipe call failed");
@@ -786,6 +1225,114 @@ evalbackcmd(union node *n, struct backcmd *result)
 		result->fd, result->buf, result->nleft, result->jp));
 }
 
+/*
+ * Evaluate a simple command from within back quotes, without forking
+ * if we can get away with it.  The substitution is a subshell, so it
+ * must not alter the state of this one: all variables assigned (by
+ * expansions, or by the command) are made local, and put back when
+ * we are done, exitstatus and LINENO are preserved, and errors only
+ * terminate the command substitution, not the shell.
+ */
+
+STATIC void
+evalbackcmd_nofork(union node *n, struct backcmd *result)
+{
+	struct jmploc jmploc;
+	struct jmploc *const savehandler = handler;
+	struct localvar *const savelocalvars = localvars;
+	const int savestatus = exitstatus;
+	const int saveline = line_number;
+	const int saveint = suppressint;
+	volatile int status = 0;
+	int e;
+
+	localvars = NULL;
+	forcelocal++;
+	if (setjmp(jmploc.loc)) {
+		handler = savehandler;
+		e = exception;
+		if (e == EXERROR || e == EXEXEC) {
+			status = e == EXEXEC ? exerrno : 2;
+			if (memout.buf != NULL) {
+				ckfree(memout.buf);
+				memout.buf = NULL;
+			}
+			out1 = &output;
+			out2 = &errout;
+		}
+		forcelocal--;
+		poplocalvars();
+		localvars = savelocalvars;
+		line_number = saveline;
+		if (e != EXERROR && e != EXEXEC)
+			longjmp(handler->loc, 1);
+	} else {
+		handler = &jmploc;
+		evalcommand(n, EV_BACKCMD, result, NULL);
+		handler = savehandler;
+		status = exitstatus;
+		forcelocal--;
+		poplocalvars();
+		localvars = savelocalvars;
+		line_number = saveline;
+	}
+	suppressint = saveint;
+	if (result->jp == NULL)
+		back_exitstatus = status;
+	exitstatus = savestatus;
+}
+
+/*
+ * Builtins that can be run without a subshell in a command substitution.
+ * They must not be able to change any shell state other than variables,
+ * which evalbackcmd_nofork() restores.  Some only qualify when they are
+ * just reporting the current state, rather than changing it.
+ *
+ * Error messages are written straight to fd 2, so if that is made a
+ * copy of another fd (2>&1) it could be the substitution's output, and
+ * the command must be run in a subshell which has that fd as well.
+ */
+
+STATIC int
+safe_backcmd(const struct cmdentry *entry, int argc, char **argv,
+    const union node *redir)
+{
+	int (*const bltin)(int, char **) = entry->u.bltin;
+
+	if (entry->cmdtype != CMDBUILTIN && entry->cmdtype != CMDSPLBLTIN)
+		return 0;
+	if (argc == 0)
+		return 0;
+	for (; redir != NULL; redir = redir->nfile.next)
+		if ((redir->type == NTOFD || redir->type == NFROMFD) &&
+		    redir->ndup.fd == 2)
+			return 0;
+
+	if (bltin == echocmd ||
+#ifndef TINY
+	    bltin == printfcmd ||
+#endif
+	    bltin == testcmd ||
+	    bltin == truecmd ||
+	    bltin == falsecmd ||
+	    bltin == typecmd ||
+	    bltin == timescmd)
+		return 1;
+
+	if (bltin == pwdcmd)		/* not -P, that alters curdir */
+		return argc == 1 || (argc == 2 && strcmp(argv[1], "-L") == 0);
+	if (bltin == trapcmd)
+		return argc == 1;
+	if (bltin == setcmd)
+		return argc == 1 || (argc == 2 &&
+		    (argv[1][0] == '-' || argv[1][0] == '+') &&
+		    argv[1][1] == 'o' && argv[1][2] == '\0');
+	if (bltin == exportcmd || bltin == umaskcmd || bltin == ulimitcmd)
+		return argc == 1 || (argc == 2 && argv[1][0] == '-');
+
+	return 0;
+}
+
 const char *
 syspath(void)
 {
@@ -838,7 +1385,8 @@ int vforked = 0;
  */
 
 STATIC void
-evalcommand(union node *cmd, int flgs, struct backcmd *backcmd)
+evalcommand(union node *cmd, int flgs, struct backcmd *backcmd,
+    struct pipecmd *pc)
 {
 	struct stackmark smark;
 	union node *argp;
@@ -867,6 +1415,9 @@ evalcommand(union node *cmd, int flgs, struct backcmd *backcmd)
 	const int savefuncline = funclinebase;
 	const int savefuncabs = funclineabs;
 	volatile int cmd_flags = 0;
+#ifndef SMALL
+	volatile int pf = -1;
+#endif
 
 	vforked = 0;
 	/* First expand the arguments. */
@@ -876,6 +1427,10 @@ evalcommand(union node *cmd, int flgs, struct backcmd *backcmd)
 	back_exitstatus = 0;
 
 	line_number = cmd->ncmd.lineno;
+#ifndef SMALL
+	if (profiling)
+		pf = profpush(NULL, line_number);
+#endif
 
 	arglist.lastp = &arglist.list;
 	varflag = 1;
@@ -915,6 +1470,7 @@ evalcommand(union node *cmd, int flgs, struct backcmd *backcmd)
 	if (iflag && funcnest == 0 && argc > 0)
 		lastarg = argv[-1];
 	argv -= argc;
+	EVTRACE(EVT_CMD, argc, 0, argv[0]);
 
 	/* Print the command if xflag is set. */
 	if (xflag) {
@@ -1044,27 +1600,34 @@ evalcommand(union node *cmd, int flgs, struct backcmd *backcmd)
 	 *
 	 * trapcmd() takes care of doing free_traps() if it is needed there.
 	 */
-	if (traps_invalid &&
+	if (traps_invalid && (flags & EV_PIPE) == 0 &&
 	    ((cmdentry.cmdtype!=CMDSPLBLTIN && cmdentry.cmdtype!=CMDBUILTIN) ||
 	     (cmdentry.u.bltin != trapcmd && cmdentry.u.bltin != evalcmd)))
 		free_traps();
 
+#ifndef SMALL
+	if (pf >= 0) {
+		profstack[pf].name = argc > 0 ? argv[0] :
+		    varlist.list != NULL ? "(assignment)" : "(redirection)";
+		profstack[pf].cmdtype = cmdentry.cmdtype;
+	}
+#endif
+
 	/* Fork off a child process if necessary. */
-	if (cmd->ncmd.backgnd
+	if (cmd->ncmd.backgnd || (flags & EV_PIPE) != 0
 	  || ((cmdentry.cmdtype == CMDNORMAL || cmdentry.cmdtype == CMDUNKNOWN)
 	     && (have_traps() || (flags & EV_EXIT) == 0))
-#ifdef notyet			/* EV_BACKCMD is never set currently */
-			/* this will need more work if/when it gets used */
 	  || ((flags & EV_BACKCMD) != 0
-	     && (cmdentry.cmdtype != CMDBUILTIN
-	         && cmdentry.cmdtype != CMDSPLBLTIN)
-	       || cmdentry.u.bltin == dotcmd
-	       || cmdentry.u.bltin == evalcmd)
-#endif
+	     && !safe_backcmd(&cmdentry, argc, argv, cmd->ncmd.redirect))
 	 ) {
 		INTOFF;
-		jp = makejob(cmd, 1);
-		mode = cmd->ncmd.backgnd;
+		if (flags & EV_PIPE) {
+			jp = pc->jp;
+			mode = pc->mode;
+		} else {
+			jp = makejob(cmd, 1);
+			mode = cmd->ncmd.backgnd;
+		}
 		if (flags & EV_BACKCMD) {
 			mode = FORK_NOJOB;
 			if (sh_pipe(pip) < 0)
@@ -1076,7 +1639,7 @@ evalcommand(union node *cmd, int flgs, struct backcmd *backcmd)
 		 * we rely on this.
 		 */
 		if (usefork == 0 && cmdentry.cmdtype == CMDNORMAL &&
-		    (!cmd->ncmd.backgnd || cmd->ncmd.redirect == NULL)) {
+		    (mode != FORK_BG || cmd->ncmd.redirect == NULL)) {
 			pid_t	pid;
 			int serrno;
 
@@ -1161,10 +1724,19 @@ evalcommand(union node *cmd, int flgs, struct backcmd *backcmd)
 		if (flags & EV_BACKCMD) {
 			if (!vforked) {
 				FORCEINTON;
+				eflag = 0;
 			}
 			close(pip[0]);
 			movefd(pip[1], 1);
 		}
+		if (flags & EV_PIPE) {
+			if (pc->in > 0)
+				movefd(pc->in, 0);
+			if (pc->out >= 0) {
+				close(pc->outrd);
+				movefd(pc->out, 1);
+			}
+		}
 		flags |= EV_EXIT;
 	}
 
@@ -1332,8 +1904,14 @@ evalcommand(union node *cmd, int flgs, struct backcmd *backcmd)
 				exitshell(exitstatus);
 		}
 		if (e != -1) {
+			/*
+			 * An error in a special builtin is fatal, but in
+			 * back quotes that means to the (virtual) subshell
+			 * only, so just treat it as we would any other.
+			 */
 			if ((e != EXERROR && e != EXEXEC)
-			    || cmdentry.cmdtype == CMDSPLBLTIN)
+			    || (cmdentry.cmdtype == CMDSPLBLTIN &&
+				(flags & EV_BACKCMD) == 0))
 				exraise(e);
 			popfilesupto(savetopfile);
 			FORCEINTON;
@@ -1363,8 +1941,14 @@ evalcommand(union node *cmd, int flgs, struct backcmd *backcmd)
 
  parent:			/* parent process gets here (if we forked) */
 
+#ifndef SMALL
+	if (pf >= 0 && cmdentry.cmdtype == CMDNORMAL)
+		profexecs++;
+#endif
 	exitstatus = 0;		/* if not altered just below */
-	if (mode == FORK_FG) {	/* argument to fork */
+	if (flags & EV_PIPE)
+		;		/* evalpipe() waits for the whole pipeline */
+	else if (mode == FORK_FG) {	/* argument to fork */
 		exitstatus = waitforjob(jp);
 	} else if (mode == FORK_NOJOB) {
 		backcmd->fd = pip[0];
@@ -1374,6 +1958,11 @@ evalcommand(union node *cmd, int flgs, struct backcmd *backcmd)
 	FORCEINTON;
 
  out:
+	EVTRACE(EVT_CMDEND, exitstatus, 0, NULL);
+#ifndef SMALL
+	if (pf >= 0)
+		profpop(pf);
+#endif
 	if (lastarg)
 		/* implement $_ for whatever use that really is */
 		(void) setvarsafe("_", lastarg, VNOERROR);
@@ -1492,21 +2081,816 @@ dotcmd(int argc, char **argv)
 		 */
 		int dot_funcnest_old;
 		struct stackmark smark;
+		struct stat statb;
+		struct jmploc jmploc;
+		struct jmploc *const savehandler = handler;
+		struct tcentry *volatile tc = NULL;
+		int replay = 0;
 
 		setstackmark(&smark);
 		fullname = find_dot_file(*argptr);
-		setinputfile(fullname, 1);
+		if (!vflag && stat(fullname, &statb) == 0 &&
+		    S_ISREG(statb.st_mode)) {
+			tc = tclookup(1, &statb, fullname, 0, 0);
+			if (tc == NULL &&
+			    (tc = tcload(&statb, fullname)) != NULL)
+				tcenter(tc);
+			if (tc != NULL)
+				replay = 1;
+			else if (statb.st_mtime < time(NULL) - 1)
+				tc = tcnew(1, &statb, fullname, 0, 0);
+		}
+		if (tc != NULL) {
+			if (setjmp(jmploc.loc)) {
+				tcrelease(tc);
+				handler = savehandler;
+				longjmp(handler->loc, 1);
+			}
+			handler = &jmploc;
+		}
+		if (!replay)
+			setinputfile(fullname, 1);
 		commandname = fullname;
 		dot_funcnest_old = dot_funcnest;
 		dot_funcnest = funcnest + 1;
-		cmdloop(0);
+		if (replay)
+			dotreplay(tc);
+		else
+			dotloop(tc);
 		dot_funcnest = dot_funcnest_old;
-		popfile();
+		if (!replay)
+			popfile();
+		if (tc != NULL) {
+			handler = savehandler;
+			tcrelease(tc);
+		}
 		popstackmark(&smark);
 	}
 	return exitstatus;
 }
 
+/*
+ * Run the commands in a file being read by ".", as cmdloop() would,
+ * keeping the trees in tc (if not NULL) if the whole file is parsed.
+ */
+
+STATIC void
+dotloop(struct tcentry *tc)
+{
+	union node *n;
+	struct stackmark smark;
+	enum skipstate skip;
+
+	setstackmark(&smark);
+	for (;;) {
+		if (pendingsigs)
+			dotrap();
+		n = parsecmd(0);
+		VXTRACE(DBG_PARSE|DBG_EVAL|DBG_CMDS, ("dotloop: "),
+		    showtree(n));
+		if (n == NEOF) {
+			if (tc != NULL)
+				tcenter(tc);
+			break;
+		}
+		if (n != NULL && tc != NULL)
+			tcaddtree(tc, n);
+		if (n != NULL && nflag == 0) {
+			job_warning = (job_warning == 2) ? 1 : 0;
+			evaltree(n, 0);
+		}
+		rststackmark(&smark);
+
+		skip = current_skipstate();
+		if (skip != SKIPNONE) {
+			if (skip == SKIPFILE)
+				stop_skipping();
+			break;
+		}
+	}
+	popstackmark(&smark);
+}
+
+/*
+ * The same, with the trees kept from an earlier time.
+ */
+
+STATIC void
+dotreplay(struct tcentry *tc)
+{
+	struct stackmark smark;
+	enum skipstate skip;
+	int i;
+
+	setstackmark(&smark);
+	for (i = 0; i < tc->ntree; i++) {
+		if (pendingsigs)
+			dotrap();
+		if (nflag == 0) {
+			job_warning = (job_warning == 2) ? 1 : 0;
+			evaltree(tc->node[i], 0);
+		}
+		rststackmark(&smark);
+
+		skip = current_skipstate();
+		if (skip != SKIPNONE) {
+			if (skip == SKIPFILE)
+				stop_skipping();
+			break;
+		}
+	}
+	popstackmark(&smark);
+}
+
+/*
+ * Find the kept trees for a file (isfile, with sb) or eval string
+ * (text, hash, lno), dropping any which are out of date.  The entry
+ * returned has a reference for the caller.
+ */
+
+STATIC struct tcentry *
+tclookup(int isfile, const struct stat *sb, const char *text,
+    unsigned int hash, int lno)
+{
+	struct tcentry *tc, **tcp;
+
+	for (tcp = &tclist; (tc = *tcp) != NULL; tcp = &tc->next) {
+		if (tc->isfile != isfile)
+			continue;
+		if (isfile) {
+			if (tc->dev != sb->st_dev || tc->ino != sb->st_ino)
+				continue;
+			if (timespeccmp(&tc->mtime, &sb->st_mtim, !=) ||
+			    timespeccmp(&tc->ctime, &sb->st_ctim, !=) ||
+			    tc->size != sb->st_size) {
+				tcremove(tc);
+				return NULL;
+			}
+		} else if (tc->hash != hash || tc->lno != lno ||
+		    strcmp(tc->text, text) != 0)
+			continue;
+		if (tc->aliasgen != aliasgen || tc->posixopt != posix) {
+			tcremove(tc);
+			return NULL;
+		}
+		INTOFF;
+		*tcp = tc->next;
+		tc->next = tclist;
+		tclist = tc;
+		tc->hits++;
+		tc->refcount++;
+		INTON;
+		return tc;
+	}
+	return NULL;
+}
+
+/*
+ * Make an (empty) entry, in which trees can be collected as they are
+ * parsed, to be entered in the cache by tcenter() if all goes well.
+ */
+
+STATIC struct tcentry *
+tcnew(int isfile, const struct stat *sb, const char *text,
+    unsigned int hash, int lno)
+{
+	struct tcentry *tc;
+
+	tc = ckmalloc(sizeof(*tc) + strlen(text));
+	tc->next = NULL;
+	tc->refcount = 1;
+	tc->isfile = isfile;
+	if (isfile) {
+		tc->dev = sb->st_dev;
+		tc->ino = sb->st_ino;
+		tc->mtime = sb->st_mtim;
+		tc->ctime = sb->st_ctim;
+		tc->size = sb->st_size;
+	}
+	tc->hash = hash;
+	tc->lno = lno;
+	tc->aliasgen = aliasgen;
+	tc->posixopt = posix;
+	tc->ntree = 0;
+	tc->lasteof = -1;
+	tc->hits = 0;
+	tc->node = NULL;
+	tc->tree = NULL;
+	tc->image = NULL;
+	tc->imagesize = 0;
+	scopy(text, tc->text);
+	return tc;
+}
+
+STATIC void
+tcaddtree(struct tcentry *tc, union node *n)
+{
+	int size;
+
+	INTOFF;
+	if ((tc->ntree & (tc->ntree - 1)) == 0) {
+		size = tc->ntree ? 2 * tc->ntree : 1;
+		tc->tree = ckrealloc(tc->tree, size * sizeof(*tc->tree));
+		tc->node = ckrealloc(tc->node, size * sizeof(*tc->node));
+	}
+	tc->tree[tc->ntree] = copyfunc(n);
+	tc->node[tc->ntree] = getfuncnode(tc->tree[tc->ntree]);
+	tc->ntree++;
+	INTON;
+}
+
+/*
+ * Put a completed entry in the cache, unless something which affects
+ * parsing changed while it was being parsed.
+ */
+
+STATIC void
+tcenter(struct tcentry *tc)
+{
+	struct tcentry *last;
+
+	if (tc->aliasgen != aliasgen || tc->posixopt != posix || vflag)
+		return;
+	if (tc->isfile && tc->image == NULL)
+		tcsave(tc);
+
+	INTOFF;
+	tc->refcount++;
+	tc->next = tclist;
+	tclist = tc;
+	if (++ntclist > TCMAX) {
+		for (last = tclist; last->next != NULL; last = last->next)
+			continue;
+		tcremove(last);
+	}
+	INTON;
+}
+
+STATIC void
+tcremove(struct tcentry *tc)
+{
+	struct tcentry **tcp;
+
+	INTOFF;
+	for (tcp = &tclist; *tcp != tc; tcp = &(*tcp)->next)
+		continue;
+	*tcp = tc->next;
+	ntclist--;
+	tcrelease(tc);
+	INTON;
+}
+
+STATIC void
+tcrelease(struct tcentry *tc)
+{
+	int i;
+
+	INTOFF;
+	if (--tc->refcount == 0) {
+		if (tc->tree != NULL) {
+			for (i = 0; i < tc->ntree; i++)
+				unreffunc(tc->tree[i]);
+			ckfree(tc->tree);
+		}
+		if (tc->node != NULL)
+			ckfree(tc->node);
+		if (tc->image != NULL)
+			munmap(tc->image, tc->imagesize);
+		ckfree(tc);
+	}
+	INTON;
+}
+
+/*
+ * The name of the image file for the file dev/ino, or NULL if images
+ * are not being kept (PARSECACHEDIR is not set), on the stack.
+ */
+
+STATIC char *
+tcimagepath(dev_t dev, ino_t ino)
+{
+	const char *dir;
+	char *path;
+	size_t len;
+
+	dir = lookupvar("PARSECACHEDIR");
+	if (dir == NULL || *dir == '\0')
+		return NULL;
+	len = strlen(dir) + 2 * 16 + 8;
+	path = stalloc(len);
+	fmtstr(path, len, "%s/sh-%llx-%llx", dir,
+	    (unsigned long long)dev, (unsigned long long)ino);
+	return path;
+}
+
+/*
+ * A checksum of an image (FNV-1a, as strhash()).  nodeload() checks
+ * the pointers and node types, but a byte changed to give a node some
+ * other valid type, or a string some other control character, gets
+ * past that, so a damaged image must be caught before it is loaded.
+ */
+
+STATIC unsigned int
+tcsum(const void *p, size_t size)
+{
+	const unsigned char *cp = p, *end = cp + size;
+	unsigned int sum = 2166136261U;
+
+	while (cp < end) {
+		sum ^= *cp++;
+		sum *= 16777619U;
+	}
+	return sum;
+}
+
+/*
+ * Map in the image of the file name (with sb), if there is one which
+ * still matches it, and make an entry for its trees.  The image file
+ * must be ours, and not writable by anyone else.
+ */
+
+STATIC struct tcentry *
+tcload(const struct stat *sb, const char *name)
+{
+	struct tcentry *tc = NULL;
+	struct tcimage *im;
+	struct stat ist;
+	char *path;
+	void *p;
+	size_t size;
+	unsigned int sum;
+	int fd, i;
+
+	if (vflag || (path = tcimagepath(sb->st_dev, sb->st_ino)) == NULL ||
+	    countaliases() != 0)
+		return NULL;
+
+	INTOFF;
+	if ((fd = open(path, O_RDONLY)) < 0)
+		goto out;
+	if (fstat(fd, &ist) != 0 || !S_ISREG(ist.st_mode) ||
+	    ist.st_uid != geteuid() || (ist.st_mode & (S_IWGRP|S_IWOTH)) ||
+	    ist.st_size < (off_t)TCIMAGEHDR(0) || ist.st_size > TCIMAGEMAX) {
+		close(fd);
+		goto out;
+	}
+	size = ist.st_size;
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		goto out;
+
+	im = p;
+	sum = im->sum;
+	im->sum = 0;
+	if (memcmp(im->magic, TCMAGIC, sizeof(im->magic)) != 0 ||
+	    im->version != TCVERSION || tcsum(p, size) != sum ||
+	    im->ptrsize != sizeof(pointer) ||
+	    im->nodesize != sizeof(union node) || im->posixopt != posix ||
+	    im->dev != sb->st_dev || im->ino != sb->st_ino ||
+	    timespeccmp(&im->mtime, &sb->st_mtim, !=) ||
+	    timespeccmp(&im->ctime, &sb->st_ctim, !=) ||
+	    im->size != sb->st_size ||
+	    im->imagesize != size || im->ntree < 0 ||
+	    (size_t)im->ntree > (size - TCIMAGEHDR(0)) / sizeof(size_t))
+		goto bad;
+	for (i = 0; i < im->ntree; i++)
+		if (im->offs[i] < TCIMAGEHDR(im->ntree))
+			goto bad;
+
+	tc = tcnew(1, sb, name, 0, 0);
+	tc->node = ckmalloc((im->ntree + 1) * sizeof(*tc->node));
+	if (!nodeload(p, size, im->offs, im->ntree, tc->node)) {
+		tcrelease(tc);
+		tc = NULL;
+		goto bad;
+	}
+	tc->ntree = im->ntree;
+	tc->image = p;
+	tc->imagesize = size;
+	goto out;
+
+ bad:
+	munmap(p, size);
+ out:
+	INTON;
+	return tc;
+}
+
+/*
+ * Write the image of the trees of a file, if PARSECACHEDIR is set.
+ * It is written to a temporary file which is then renamed, so no shell
+ * ever sees half of one.  This is only for speed, any error is ignored.
+ */
+
+STATIC void
+tcsave(struct tcentry *tc)
+{
+	struct tcimage *im;
+	size_t *offs;
+	size_t size;
+	char *path, *tmp;
+	int fd, ok;
+
+	if ((path = tcimagepath(tc->dev, tc->ino)) == NULL ||
+	    countaliases() != 0)
+		return;
+	tmp = stalloc(strlen(path) + 16);
+	fmtstr(tmp, strlen(path) + 16, "%s.%d", path, (int)getpid());
+
+	INTOFF;
+	offs = ckmalloc((tc->ntree + 1) * sizeof(*offs));
+	im = nodeimage(tc->node, tc->ntree, TCIMAGEHDR(tc->ntree), offs,
+	    &size);
+	memcpy(im->magic, TCMAGIC, sizeof(im->magic));
+	im->version = TCVERSION;
+	im->ptrsize = sizeof(pointer);
+	im->nodesize = sizeof(union node);
+	im->posixopt = tc->posixopt;
+	im->dev = tc->dev;
+	im->ino = tc->ino;
+	im->mtime = tc->mtime;
+	im->ctime = tc->ctime;
+	im->size = tc->size;
+	im->imagesize = size;
+	im->ntree = tc->ntree;
+	memcpy(im->offs, offs, tc->ntree * sizeof(*offs));
+	ckfree(offs);
+	im->sum = 0;
+	im->sum = tcsum(im, size);
+
+	if (size <= TCIMAGEMAX &&
+	    (fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0600)) >= 0) {
+		ok = xwrite(fd, (char *)im, size) == (int)size;
+		if (close(fd) != 0)
+			ok = 0;
+		if (!ok || rename(tmp, path) != 0)
+			unlink(tmp);
+	}
+	ckfree(im);
+	INTON;
+}
+
+#ifndef SMALL
+/*
+ * The parsecache builtin: list what is in the cache (most recently
+ * used first) or, with -c, empty it.
+ */
+
+int
+parsecachecmd(int argc, char **argv)
+{
+	struct tcentry *tc;
+	int clear = 0;
+	int len;
+
+	while (nextopt("c") != '\0')
+		clear = 1;
+
+	if (clear) {
+		while (tclist != NULL)
+			tcremove(tclist);
+		memset(tcseen, 0, sizeof(tcseen));
+		return 0;
+	}
+
+	for (tc = tclist; tc != NULL; tc = tc->next) {
+		len = strcspn(tc->text, "\n");
+		out1fmt("%s %lu %d %.*s%s\n", tc->isfile ? "file" : "eval",
+		    tc->hits, tc->ntree, len > 60 ? 60 : len, tc->text,
+		    len > 60 || tc->text[len] != '\0' ? "..." : "");
+	}
+	return 0;
+}
+
+/*
+ * The profiler, see the comment with struct profframe.
+ */
+
+STATIC void
+profsample(struct proftimes *pt)
+{
+	struct timespec ts;
+	struct rusage self, kids;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	(void)getrusage(RUSAGE_SELF, &self);
+	(void)getrusage(RUSAGE_CHILDREN, &kids);
+	pt->wall = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	pt->user = (uint64_t)(self.ru_utime.tv_sec + kids.ru_utime.tv_sec) *
+	    1000000 + self.ru_utime.tv_usec + kids.ru_utime.tv_usec;
+	pt->sys = (uint64_t)(self.ru_stime.tv_sec + kids.ru_stime.tv_sec) *
+	    1000000 + self.ru_stime.tv_usec + kids.ru_stime.tv_usec;
+	pt->forks = nforks;
+	pt->execs = profexecs;
+}
+
+/* *d = *a - *b, where that is not below 0 */
+STATIC void
+profdiff(struct proftimes *d, const struct proftimes *a,
+    const struct proftimes *b)
+{
+	d->wall = a->wall > b->wall ? a->wall - b->wall : 0;
+	d->user = a->user > b->user ? a->user - b->user : 0;
+	d->sys = a->sys > b->sys ? a->sys - b->sys : 0;
+	d->forks = a->forks > b->forks ? a->forks - b->forks : 0;
+	d->execs = a->execs > b->execs ? a->execs - b->execs : 0;
+}
+
+STATIC void
+profsum(struct proftimes *d, const struct proftimes *a)
+{
+	d->wall += a->wall;
+	d->user += a->user;
+	d->sys += a->sys;
+	d->forks += a->forks;
+	d->execs += a->execs;
+}
+
+/*
+ * Start a frame, returning its index in profstack.
+ */
+STATIC int
+profpush(const char *name, int line)
+{
+	struct profframe *pf;
+	int i;
+
+	if (profdepth == profmax) {
+		INTOFF;
+		profmax = profmax ? profmax * 2 : 32;
+		profstack = ckrealloc(profstack, profmax * sizeof *profstack);
+		INTON;
+	}
+	i = profdepth++;
+	pf = &profstack[i];
+	pf->name = name;
+	pf->cmdtype = -1;
+	pf->line = line;
+	if (i == 0)
+		pf->func = -1;
+	else if (pf[-1].cmdtype == CMDFUNCTION)
+		pf->func = i - 1;
+	else
+		pf->func = pf[-1].func;
+	memset(&pf->inner, 0, sizeof pf->inner);
+	profsample(&pf->start);
+	return i;
+}
+
+/*
+ * Finish frame i (and any abandoned above it), and charge its times.
+ */
+STATIC void
+profpop(int i)
+{
+	struct profframe *pf;
+	struct proftimes now, total, self;
+	const char *s;
+	char *p;
+	int j;
+
+	if (i >= profdepth)		/* gone with a reset */
+		return;
+	profdepth = i;
+	if (!profiling)
+		return;
+	pf = &profstack[i];
+	profsample(&now);
+	profdiff(&total, &now, &pf->start);
+	profdiff(&self, &total, &pf->inner);
+	if (i > 0)
+		profsum(&pf[-1].inner, &total);
+	if (pf->name == NULL)		/* an exception before it was known */
+		return;
+
+	profadd(PE_LINE, pf->func >= 0 ? profstack[pf->func].name : "",
+	    pf->line, &self);
+	if (pf->cmdtype == CMDNORMAL)
+		profadd(PE_CMD, pf->name, 0, &total);
+	else if (pf->cmdtype == CMDFUNCTION) {
+		/* a recursive call is already in the time of the outer one */
+		for (j = pf->func; j >= 0; j = profstack[j].func)
+			if (strcmp(profstack[j].name, pf->name) == 0)
+				break;
+		if (j >= 0)
+			memset(&total, 0, sizeof total);
+		profadd(PE_FUNC, pf->name, 0, &total);
+	}
+
+	STARTSTACKSTR(p);
+	for (s = arg0; *s != '\0'; s++)
+		STPUTC(*s, p);
+	for (j = 0; j <= i; j++) {
+		if (j < i && profstack[j].cmdtype != CMDFUNCTION)
+			continue;
+		STPUTC(';', p);
+		for (s = profstack[j].name; *s != '\0'; s++)
+			STPUTC(*s, p);
+	}
+	STPUTC('\0', p);
+	profadd(PE_STACK, stackblock(), 0, &self);
+}
+
+STATIC void
+profadd(int kind, const char *name, int line, const struct proftimes *t)
+{
+	struct profent *pe, **pp, **otab;
+	unsigned int hash;
+	const char *p;
+	int i, osize;
+
+	hash = kind * 31 + line;
+	for (p = name; *p != '\0'; p++)
+		hash = hash * 31 + (unsigned char)*p;
+
+	if (proftabsize != 0)
+		for (pe = proftab[hash & (proftabsize - 1)]; pe != NULL;
+		    pe = pe->next)
+			if (pe->hash == hash && pe->kind == kind &&
+			    pe->line == line && strcmp(pe->name, name) == 0)
+				goto found;
+
+	INTOFF;
+	if (nprofent >= proftabsize) {
+		otab = proftab;
+		osize = proftabsize;
+		proftabsize = osize ? osize * 2 : 256;
+		proftab = ckmalloc(proftabsize * sizeof *proftab);
+		memset(proftab, 0, proftabsize * sizeof *proftab);
+		for (i = 0; i < osize; i++)
+			while ((pe = otab[i]) != NULL) {
+				otab[i] = pe->next;
+				pp = &proftab[pe->hash & (proftabsize - 1)];
+				pe->next = *pp;
+				*pp = pe;
+			}
+		if (otab != NULL)
+			ckfree(otab);
+	}
+	pe = ckmalloc(sizeof *pe + strlen(name));
+	memset(pe, 0, sizeof *pe);
+	pe->hash = hash;
+	pe->kind = kind;
+	pe->line = line;
+	strcpy(pe->name, name);
+	pp = &proftab[hash & (proftabsize - 1)];
+	pe->next = *pp;
+	*pp = pe;
+	nprofent++;
+	INTON;
+ found:
+	pe->count++;
+	profsum(&pe->t, t);
+}
+
+STATIC void
+profclear(void)
+{
+	struct profent *pe;
+	int i;
+
+	INTOFF;
+	for (i = 0; i < proftabsize; i++)
+		while ((pe = proftab[i]) != NULL) {
+			proftab[i] = pe->next;
+			ckfree(pe);
+		}
+	nprofent = 0;
+	INTON;
+}
+
+/*
+ * The line a pipeline or subshell starts on, as near as can be told.
+ */
+STATIC int
+profline(union node *n)
+{
+	if (n->type == NPIPE)
+		n = n->npipe.cmdlist->n;
+	else
+		n = n->nredir.n;
+	return n->type == NCMD ? n->ncmd.lineno : line_number;
+}
+
+static char *
+profsecs(char *buf, size_t len, uint64_t us)
+{
+	snprintf(buf, len, "%lu.%06lu", (unsigned long)(us / 1000000),
+	    (unsigned long)(us % 1000000));
+	return buf;
+}
+
+static int
+profcmp(const void *a, const void *b)
+{
+	const struct profent *pa = *(const struct profent * const *)a;
+	const struct profent *pb = *(const struct profent * const *)b;
+
+	if (pa->t.wall != pb->t.wall)
+		return pa->t.wall > pb->t.wall ? -1 : 1;
+	return strcmp(pa->name, pb->name);
+}
+
+/*
+ * Print the entries of one kind, most time first.
+ */
+STATIC void
+profreport(int kind, const char *title, int max)
+{
+	struct profent **v, *pe;
+	char where[64], wall[24], user[24], sys[24];
+	const char *what;
+	int i, n;
+
+	v = stalloc((nprofent + 1) * sizeof *v);
+	n = 0;
+	for (i = 0; i < proftabsize; i++)
+		for (pe = proftab[i]; pe != NULL; pe = pe->next)
+			if (pe->kind == kind)
+				v[n++] = pe;
+	if (n == 0)
+		return;
+	qsort(v, n, sizeof *v, profcmp);
+	if (max > 0 && n > max)
+		n = max;
+
+	if (kind != PE_STACK)
+		out1fmt("%-24s %8s %14s %14s %14s %6s %6s\n", title, "count",
+		    "wall", "user", "sys", "forks", "execs");
+	for (i = 0; i < n; i++) {
+		pe = v[i];
+		if (kind == PE_STACK) {
+			out1fmt("%s %lu\n", pe->name, (unsigned long)pe->t.wall);
+			continue;
+		}
+		what = pe->name;
+		if (kind == PE_LINE) {
+			fmtstr(where, sizeof where, "%s%s%d", pe->name,
+			    *pe->name ? ":" : "", pe->line);
+			what = where;
+		}
+		out1fmt("%-24s %8lu %14s %14s %14s %6lu %6lu\n",
+		    what, pe->count, profsecs(wall, sizeof wall, pe->t.wall),
+		    profsecs(user, sizeof user, pe->t.user),
+		    profsecs(sys, sizeof sys, pe->t.sys),
+		    pe->t.forks, pe->t.execs);
+	}
+}
+
+/*
+ * The profile builtin: -b begins profiling (afresh), -e ends it, -c
+ * discards what has been found.  Otherwise print what has been found
+ * (at most count entries of each kind with -n), per line, function and
+ * external command, or with -f as folded stacks for flame graph tools.
+ */
+
+int
+profilecmd(int argc, char **argv)
+{
+	int action = 0;
+	int folded = 0;
+	int max = 0;
+	int c;
+
+	while ((c = nextopt("becfn:")) != '\0') {
+		switch (c) {
+		case 'f':
+			folded = 1;
+			break;
+		case 'n':
+			max = number(optionarg);
+			break;
+		default:
+			action = c;
+			break;
+		}
+	}
+
+	switch (action) {
+	case 'b':
+		profclear();
+		profiling = 1;
+		return 0;
+	case 'e':
+		profiling = 0;
+		return 0;
+	case 'c':
+		profclear();
+		return 0;
+	}
+
+	if (folded) {
+		profreport(PE_STACK, NULL, max);
+		return 0;
+	}
+	profreport(PE_LINE, "line", max);
+	profreport(PE_FUNC, "function", max);
+	profreport(PE_CMD, "command", max);
+	return 0;
+}
+#endif
+
 /*
  * allow dotfile function nesting to be manipulated
  * (for read_profile).  This allows profile files to
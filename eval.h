@@ -38,6 +38,8 @@ extern const char *commandname;	/* currently executing command */
 extern int exitstatus;		/* exit status of last command */
 extern int back_exitstatus;	/* exit status of backquoted command */
 extern struct strlist *cmdenviron;  /* environment for builtin command */
+extern int vforked;		/* this is a vfork() child (still) */
+extern int profiling;		/* "profile -b": timing commands */
 
 
 struct backcmd {		/* result of evalbackcmd */
@@ -86,3 +88,4 @@ void reset_eval(void);
 #define EV_EXIT		0x01	/* exit after evaluating tree */
 #define EV_TESTED	0x02	/* exit status is checked; ignore -e flag */
 #define EV_BACKCMD	0x04	/* command executing within back quotes */
+#define EV_PIPE		0x08	/* command is a member of a pipeline */
@@ -0,0 +1,183 @@
+/*-
+ * Copyright (c) 2026 The ash authors.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * evdump - print the event rings made by "debug -b" in sh.
+ *
+ *	evdump /tmp/sh-events.*
+ *
+ * The events of all the files named are merged into time order, one
+ * per line: seconds since the earliest ring was made, pid, the line
+ * number in the script, the event, and what it recorded.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "evtrace.h"
+
+static struct evt_rec *evs;
+static size_t nevs;
+static uint64_t base;		/* earliest eh_base */
+static uint64_t start;		/* its eh_start */
+
+static const char *const evnames[] = {
+	[EVT_CMD] =	"cmd",
+	[EVT_CMDEND] =	"cmdend",
+	[EVT_FORK] =	"fork",
+	[EVT_EXEC] =	"exec",
+	[EVT_WAIT] =	"wait",
+	[EVT_REDIR] =	"redir",
+	[EVT_TRAP] =	"trap",
+};
+
+static void
+readring(const char *file)
+{
+	static struct evt_ring r;
+	FILE *f;
+	uint64_t n, first;
+
+	if ((f = fopen(file, "r")) == NULL)
+		err(1, "%s", file);
+	if (fread(&r, sizeof r, 1, f) != 1)
+		errx(1, "%s: short file", file);
+	fclose(f);
+	if (memcmp(r.er_hdr.eh_magic, EVT_MAGIC, sizeof r.er_hdr.eh_magic) ||
+	    r.er_hdr.eh_version != EVT_VERSION ||
+	    r.er_hdr.eh_recsize != sizeof (struct evt_rec) ||
+	    r.er_hdr.eh_nrec != EVT_NREC)
+		errx(1, "%s: not an event ring this evdump understands", file);
+
+	if (nevs == 0 || r.er_hdr.eh_base < base) {
+		base = r.er_hdr.eh_base;
+		start = r.er_hdr.eh_start;
+	}
+	first = r.er_hdr.eh_next > EVT_NREC ? r.er_hdr.eh_next - EVT_NREC : 0;
+	if (first != 0)
+		warnx("%s: %ju events before these were lost", file,
+		    (uintmax_t)first);
+
+	evs = realloc(evs, (nevs + EVT_NREC) * sizeof *evs);
+	if (evs == NULL)
+		err(1, NULL);
+	for (n = first; n < r.er_hdr.eh_next; n++)
+		evs[nevs++] = r.er_rec[n & (EVT_NREC - 1)];
+}
+
+static int
+evcmp(const void *a, const void *b)
+{
+	const struct evt_rec *ea = a, *eb = b;
+
+	if (ea->er_time != eb->er_time)
+		return ea->er_time < eb->er_time ? -1 : 1;
+	return 0;
+}
+
+static void
+printev(const struct evt_rec *er)
+{
+	uint64_t t = er->er_time - base;
+
+	printf("%4ju.%06ju %6d %5d ", (uintmax_t)(t / 1000000000),
+	    (uintmax_t)(t % 1000000000 / 1000), er->er_pid, er->er_line);
+	if (er->er_type < sizeof evnames / sizeof evnames[0] &&
+	    evnames[er->er_type] != NULL)
+		printf("%-7s", evnames[er->er_type]);
+	else
+		printf("?%-6u", er->er_type);
+
+	switch (er->er_type) {
+	case EVT_CMD:
+		printf("%s (%d args)", er->er_text, er->er_a);
+		break;
+	case EVT_CMDEND:
+		printf("status %d", er->er_a);
+		break;
+	case EVT_FORK:
+		printf("child %d %s", er->er_a, er->er_b == 0 ? "fg" :
+		    er->er_b == 1 ? "bg" : "nojob");
+		break;
+	case EVT_EXEC:
+		printf("%s", er->er_text);
+		break;
+	case EVT_WAIT:
+		printf("pid %d ", er->er_a);
+		if (WIFEXITED(er->er_b))
+			printf("exit %d", WEXITSTATUS(er->er_b));
+		else if (WIFSIGNALED(er->er_b))
+			printf("signal %d", WTERMSIG(er->er_b));
+		else if (WIFSTOPPED(er->er_b))
+			printf("stopped %d", WSTOPSIG(er->er_b));
+		else
+			printf("status %#x", er->er_b);
+		break;
+	case EVT_REDIR:
+		if (er->er_b >= 0)
+			printf("fd %d dup %d", er->er_a, er->er_b);
+		else if (er->er_text[0] != '\0')
+			printf("fd %d %s", er->er_a, er->er_text);
+		else
+			printf("fd %d", er->er_a);
+		break;
+	case EVT_TRAP:
+		printf("signal %d", er->er_a);
+		break;
+	default:
+		printf("%d %d %s", er->er_a, er->er_b, er->er_text);
+		break;
+	}
+	putchar('\n');
+}
+
+int
+main(int argc, char **argv)
+{
+	char when[64];
+	time_t secs;
+	size_t i;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: evdump file ...\n");
+		return 2;
+	}
+	while (*++argv)
+		readring(*argv);
+	qsort(evs, nevs, sizeof *evs, evcmp);
+
+	secs = start / 1000000000;
+	strftime(when, sizeof when, "%Y-%m-%d %H:%M:%S", localtime(&secs));
+	printf("# %zu events, times since %s\n", nevs, when);
+	for (i = 0; i < nevs; i++)
+		printev(&evs[i]);
+	return 0;
+}
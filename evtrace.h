@@ -0,0 +1,86 @@
+/*-
+ * Copyright (c) 2026 The ash authors.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Layout of the event ring written by "debug -b" (see evtrace() in
+ * show.c), shared with evdump, which decodes it.
+ *
+ * The shell maps a file, "sh-events.<pid>.XXXXXX" in $EVENTDIR (or
+ * _PATH_TMP), holding a header and EVT_NREC fixed size records, which
+ * the subshells it forks record into as well.  Event number n is
+ * stored in er_rec[n % EVT_NREC], so once the ring has wrapped only
+ * the last EVT_NREC events before eh_next are left.
+ */
+
+#ifndef EVTRACE_H
+#define EVTRACE_H
+
+#include <stdint.h>
+
+#define	EVT_MAGIC	"shevents"
+#define	EVT_VERSION	1
+#define	EVT_NREC	4096		/* must be a power of 2 */
+#define	EVT_TEXT	36		/* including the terminating \0 */
+
+/* event types (er_type), and what er_a, er_b and er_text hold */
+#define	EVT_CMD		1	/* simple command: argc, -, argv[0] */
+#define	EVT_CMDEND	2	/* it finished: exit status, -, - */
+#define	EVT_FORK	3	/* in the parent: child pid, FORK_ mode, - */
+#define	EVT_EXEC	4	/* about to execve: -, -, pathname */
+#define	EVT_WAIT	5	/* a child was reaped: pid, wait status, - */
+#define	EVT_REDIR	6	/* redirection: fd, dup fd or -1, filename */
+#define	EVT_TRAP	7	/* running a trap: signal number, -, - */
+
+struct evt_rec {
+	uint64_t	er_time;	/* CLOCK_MONOTONIC, in nanoseconds */
+	int32_t		er_pid;		/* the process that recorded it */
+	uint16_t	er_type;
+	uint16_t	er_spare;
+	int32_t		er_a;
+	int32_t		er_b;
+	int32_t		er_line;	/* line_number when recorded */
+	char		er_text[EVT_TEXT];
+};
+
+struct evt_header {
+	char		eh_magic[8];	/* EVT_MAGIC, not \0 terminated */
+	uint32_t	eh_version;
+	uint32_t	eh_recsize;	/* sizeof (struct evt_rec) */
+	uint32_t	eh_nrec;	/* EVT_NREC */
+	int32_t		eh_pid;		/* the process that owns the ring */
+	int32_t		eh_ppid;	/* and its parent */
+	uint32_t	eh_spare;
+	uint64_t	eh_next;	/* number of events ever recorded */
+	uint64_t	eh_base;	/* CLOCK_MONOTONIC when created */
+	uint64_t	eh_start;	/* the same moment, CLOCK_REALTIME */
+	uint64_t	eh_spare2;
+};
+
+struct evt_ring {
+	struct evt_header	er_hdr;
+	struct evt_rec		er_rec[EVT_NREC];
+};
+
+#endif /* EVTRACE_H */
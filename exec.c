@@ -50,6 +50,7 @@ __RCSID("$NetBSD: exec.c,v 1.53 2018/07/25 14:42:50 kre Exp $");
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 /*
  * When commands are first encountered, they are entered in a hash table.
@@ -82,11 +83,24 @@ __RCSID("$NetBSD: exec.c,v 1.53 2018/07/25 14:42:50 kre Exp $");
 #include "alias.h"
 
 
-#define CMDTABLESIZE 31		/* should be prime */
+#define CMDTABLESIZE 32		/* initial size, must be a power of 2 */
+#define CMDNEGMAX 256		/* most "not found" entries to remember */
 #define ARB 1			/* actual size determined at run time */
 
 
 
+/*
+ * The command table also remembers names that were not found in PATH
+ * (cmdtype CMDUNKNOWN, the errno to report in param.index), so looking
+ * for them again does not need a stat() per PATH component.  These
+ * are believed only while gen == pathgen, which changes with PATH, on
+ * cd (for relative PATH entries), and when we see that a directory in
+ * PATH has been modified.  We look (stat the directories) after we
+ * may have done something which could have changed the filesystem,
+ * that is, when fschanged has been set, and otherwise at most once a
+ * second, so something else installing a command is noticed too.
+ */
+
 struct tblentry {
 	struct tblentry *next;	/* next entry in hash chain */
 	union param param;	/* definition of builtin function */
@@ -94,13 +108,33 @@ struct tblentry {
 	char rehash;		/* if set, cd done since entry created */
 	char fn_ln1;		/* for functions, LINENO from 1 */
 	int lineno;		/* for functions abs LINENO of definition */
+	unsigned int hash;	/* hash of cmdname */
+	unsigned int gen;	/* for not found entries, pathgen when made */
 	char cmdname[ARB];	/* name of command */
 };
 
+/* a "not found" entry (not one cmdlookup() has only just made) */
+#define NEGENTRY(cmdp) ((cmdp)->cmdtype == CMDUNKNOWN && (cmdp)->gen != 0)
+
+struct pathdir {		/* what a PATH directory looked like */
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+};
+
 
-STATIC struct tblentry *cmdtable[CMDTABLESIZE];
+STATIC struct tblentry *cmdtable_init[CMDTABLESIZE];
+STATIC struct tblentry **cmdtable = cmdtable_init;
+STATIC unsigned int cmdtablesize = CMDTABLESIZE;  /* buckets in cmdtable */
+STATIC unsigned int ncmds;		/* entries in cmdtable */
+STATIC unsigned int nnegcmds;		/* of which are "not found" */
+STATIC unsigned int pathgen = 1;	/* generation of PATH, never 0 */
+STATIC struct pathdir *pathdirs;	/* state of each dir in PATH */
+STATIC int npathdirs;
+STATIC time_t pathdirtime;		/* when pathdirs[] was last checked */
 STATIC int builtinloc = -1;		/* index in path of %builtin, or -1 */
 int exerrno = 0;			/* Last exec error */
+int fschanged = 1;			/* PATH directories may have changed */
 
 
 STATIC void tryexec(char *, char **, char **, int);
@@ -109,14 +143,15 @@ STATIC void addcmdentry(char *, struct cmdentry *);
 STATIC void clearcmdentry(int);
 STATIC struct tblentry *cmdlookup(const char *, int);
 STATIC void delete_cmd_entry(void);
+STATIC void growcmdtable(void);
+STATIC void checkpathdirs(void);
+STATIC void clearnegcmds(void);
+STATIC void newpathgen(void);
 
 #ifndef BSD
 STATIC void execinterp(char **, char **);
 #endif
 
-
-extern const char *const parsekwd[];
-
 /*
  * Exec a program.  Never returns.  If you change this routine, you may
  * have to change the find_command routine as well.
@@ -180,6 +215,7 @@ tryexec(char *cmd, char **argv, char **envp, int vforked)
 	char *p;
 #endif
 
+	EVTRACE(EVT_EXEC, 0, 0, cmd);
 #ifdef SYSV
 	do {
 		execve(cmd, argv, envp);
@@ -380,7 +416,7 @@ hashcmd(int argc, char **argv)
 		allopt = bopt = fopt = sopt = uopt = 1;
 
 	if (*argptr == NULL) {
-		for (pp = cmdtable ; pp < &cmdtable[CMDTABLESIZE] ; pp++) {
+		for (pp = cmdtable ; pp < &cmdtable[cmdtablesize] ; pp++) {
 			for (cmdp = *pp ; cmdp ; cmdp = cmdp->next) {
 				switch (cmdp->cmdtype) {
 				case CMDNORMAL:
@@ -399,7 +435,7 @@ hashcmd(int argc, char **argv)
 					if (!fopt)
 						continue;
 					break;
-				default:	/* never happens */
+				default:	/* a name known not to exist */
 					continue;
 				}
 				if (!allopt || verbose ||
@@ -432,6 +468,9 @@ hashcmd(int argc, char **argv)
 				if (!fopt)
 					continue;
 				break;
+			case CMDUNKNOWN:	/* look again */
+				delete_cmd_entry();
+				break;
 			}
 		}
 		find_command(name, &entry, DO_ERR, pathval());
@@ -551,6 +590,19 @@ find_command(char *name, struct cmdentry *entry, int act, const char *path)
 	if ((cmdp = cmdlookup(name, 0)) != NULL) {
 		do {
 			switch (cmdp->cmdtype) {
+			case CMDUNKNOWN:
+				if (act & DO_ALTPATH) {
+					cmdp = NULL;
+					continue;
+				}
+				checkpathdirs();
+				if (cmdp->gen == pathgen) {
+					e = cmdp->param.index;
+					goto notfound;
+				}
+				delete_cmd_entry();	/* stale */
+				cmdp = NULL;
+				continue;
 			case CMDNORMAL:
 				if (act & DO_ALTPATH) {
 					cmdp = NULL;
@@ -590,6 +642,13 @@ find_command(char *name, struct cmdentry *entry, int act, const char *path)
 			prev = cmdp->param.index;
 	}
 
+	/*
+	 * Know what the PATH directories look like before we search them,
+	 * so a "not found" entry we make cannot miss a later change.
+	 */
+	if (!(act & DO_ALTPATH))
+		checkpathdirs();
+
 	e = ENOENT;
 	idx = -1;
 loop:
@@ -677,6 +736,20 @@ loop:
 	/* We failed.  If there was an entry for this command, delete it */
 	if (cmdp)
 		delete_cmd_entry();
+	if (!(act & DO_ALTPATH)) {
+		INTOFF;
+		if (nnegcmds >= CMDNEGMAX)
+			clearnegcmds();
+		cmdp = cmdlookup(name, 1);
+		/* but keep a function that "command name" skipped */
+		if (cmdp->cmdtype == CMDUNKNOWN) {
+			cmdp->param.index = e;
+			cmdp->gen = pathgen;
+			nnegcmds++;
+		}
+		INTON;
+	}
+ notfound:
 	if (act & DO_ERR)
 		outfmt(out2, "%s: %s\n", name, errmsg(e, E_EXEC));
 	entry->cmdtype = CMDUNKNOWN;
@@ -708,19 +781,19 @@ success:
 
 
 /*
- * Search the table of builtin commands.
+ * Search the table of builtin commands.  Any name starting with %
+ * (%1, %+, ...) is the % command.
  */
 
 int
 (*find_builtin(char *name))(int, char **)
 {
 	const struct builtincmd *bp;
+	const char *s = *name == '%' ? "%" : name;
 
-	for (bp = builtincmd ; bp->name ; bp++) {
-		if (*bp->name == *name
-		    && (*name == '%' || equal(bp->name, name)))
-			return bp->builtin;
-	}
+	bp = &builtincmd[perfhash(s, BLTINHASHMULT) & (BLTINHASHSIZE - 1)];
+	if (bp->name != NULL && *bp->name == *s && equal(bp->name, s))
+		return bp->builtin;
 	return 0;
 }
 
@@ -729,10 +802,10 @@ int
 {
 	const struct builtincmd *bp;
 
-	for (bp = splbltincmd ; bp->name ; bp++) {
-		if (*bp->name == *name && equal(bp->name, name))
-			return bp->builtin;
-	}
+	bp = &splbltincmd[perfhash(name, SPLBLTINHASHMULT) &
+	    (SPLBLTINHASHSIZE - 1)];
+	if (bp->name != NULL && *bp->name == *name && equal(bp->name, name))
+		return bp->builtin;
 	return 0;
 }
 
@@ -749,7 +822,9 @@ hash_special_builtins(void)
 	const struct builtincmd *bp;
 	struct tblentry *cmdp;
 
-	for (bp = splbltincmd ; bp->name ; bp++) {
+	for (bp = splbltincmd ; bp < splbltincmd + SPLBLTINHASHSIZE ; bp++) {
+		if (bp->name == NULL)
+			continue;
 		cmdp = cmdlookup(bp->name, 1);
 		cmdp->cmdtype = CMDSPLBLTIN;
 		cmdp->param.bltin = bp->builtin;
@@ -769,7 +844,8 @@ hashcd(void)
 	struct tblentry **pp;
 	struct tblentry *cmdp;
 
-	for (pp = cmdtable ; pp < &cmdtable[CMDTABLESIZE] ; pp++) {
+	newpathgen();		/* relative PATH entries now mean elsewhere */
+	for (pp = cmdtable ; pp < &cmdtable[cmdtablesize] ; pp++) {
 		for (cmdp = *pp ; cmdp ; cmdp = cmdp->next) {
 			if (cmdp->cmdtype == CMDNORMAL
 			 || (cmdp->cmdtype == CMDBUILTIN && builtinloc >= 0))
@@ -823,12 +899,15 @@ changepath(const char *newval)
 		firstchange = 0;
 	clearcmdentry(firstchange);
 	builtinloc = bltin;
+	newpathgen();
+	fschanged = 1;		/* pathdirs[] must be redone */
 }
 
 
 /*
  * Clear out command entries.  The argument specifies the first entry in
- * PATH which has changed.
+ * PATH which has changed.  Any "not found" entries go as well, as a new
+ * entry anywhere in PATH may hold what was not there before.
  */
 
 STATIC void
@@ -839,24 +918,126 @@ clearcmdentry(int firstchange)
 	struct tblentry *cmdp;
 
 	INTOFF;
-	for (tblp = cmdtable ; tblp < &cmdtable[CMDTABLESIZE] ; tblp++) {
+	for (tblp = cmdtable ; tblp < &cmdtable[cmdtablesize] ; tblp++) {
 		pp = tblp;
 		while ((cmdp = *pp) != NULL) {
 			if ((cmdp->cmdtype == CMDNORMAL &&
 			     cmdp->param.index >= firstchange)
 			 || (cmdp->cmdtype == CMDBUILTIN &&
-			     builtinloc >= firstchange)) {
+			     builtinloc >= firstchange)
+			 || cmdp->cmdtype == CMDUNKNOWN) {
+				if (NEGENTRY(cmdp))
+					nnegcmds--;
+				*pp = cmdp->next;
+				ckfree(cmdp);
+				ncmds--;
+			} else {
+				pp = &cmdp->next;
+			}
+		}
+	}
+	INTON;
+}
+
+
+/*
+ * Forget all the names we could not find, when there are too many.
+ */
+
+STATIC void
+clearnegcmds(void)
+{
+	struct tblentry **tblp;
+	struct tblentry **pp;
+	struct tblentry *cmdp;
+
+	INTOFF;
+	for (tblp = cmdtable ; tblp < &cmdtable[cmdtablesize] ; tblp++) {
+		pp = tblp;
+		while ((cmdp = *pp) != NULL) {
+			if (cmdp->cmdtype == CMDUNKNOWN) {
 				*pp = cmdp->next;
 				ckfree(cmdp);
+				ncmds--;
 			} else {
 				pp = &cmdp->next;
 			}
 		}
 	}
+	nnegcmds = 0;
 	INTON;
 }
 
 
+/*
+ * If something might have altered the filesystem since we last looked,
+ * or we have not looked this second, check whether any of the
+ * directories in PATH has changed, and if so, invalidate all the
+ * "not found" entries in the command table.
+ */
+
+STATIC void
+checkpathdirs(void)
+{
+	const char *path;
+	char *dir;
+	struct stat statb;
+	struct pathdir *pd;
+	time_t now;
+	int changed = 0;
+	int i;
+
+	now = time(NULL);
+	if (!fschanged && now == pathdirtime)
+		return;
+	fschanged = 0;
+	pathdirtime = now;
+
+	path = pathval();
+	for (i = 0; (dir = padvance(&path, "", 1)) != NULL; i++) {
+		if (i >= npathdirs) {
+			INTOFF;
+			pathdirs = ckrealloc(pathdirs, (i + 1) * sizeof *pd);
+			memset(&pathdirs[i], 0, sizeof *pd);
+			INTON;
+			changed = 1;
+		}
+		if (pathopt != NULL ||
+		    stat(*dir != '\0' ? dir : ".", &statb) != 0)
+			memset(&statb, 0, sizeof statb);
+		stunalloc(dir);
+		pd = &pathdirs[i];
+		if (pd->dev != statb.st_dev || pd->ino != statb.st_ino ||
+		    timespeccmp(&pd->mtime, &statb.st_mtim, !=)) {
+			pd->dev = statb.st_dev;
+			pd->ino = statb.st_ino;
+			pd->mtime = statb.st_mtim;
+			changed = 1;
+		}
+	}
+	if (i != npathdirs)
+		changed = 1;
+	npathdirs = i;
+
+	if (changed) {
+		VTRACE(DBG_CMDS, ("checkpathdirs: PATH directory changed\n"));
+		newpathgen();
+	}
+}
+
+/*
+ * Make all existing "not found" entries stale.  A gen of 0 is
+ * what an entry just made by cmdlookup() has, so skip that.
+ */
+
+STATIC void
+newpathgen(void)
+{
+	if (++pathgen == 0)
+		pathgen = 1;
+}
+
+
 /*
  * Delete all functions.
  */
@@ -882,13 +1063,14 @@ deletefuncs(void)
 	struct tblentry *cmdp;
 
 	INTOFF;
-	for (tblp = cmdtable ; tblp < &cmdtable[CMDTABLESIZE] ; tblp++) {
+	for (tblp = cmdtable ; tblp < &cmdtable[cmdtablesize] ; tblp++) {
 		pp = tblp;
 		while ((cmdp = *pp) != NULL) {
 			if (cmdp->cmdtype == CMDFUNCTION) {
 				*pp = cmdp->next;
 				freefunc(cmdp->param.func);
 				ckfree(cmdp);
+				ncmds--;
 			} else {
 				pp = &cmdp->next;
 			}
@@ -913,36 +1095,72 @@ struct tblentry **lastcmdentry;
 STATIC struct tblentry *
 cmdlookup(const char *name, int add)
 {
-	int hashval;
-	const char *p;
+	unsigned int hashval;
+	int len;
 	struct tblentry *cmdp;
 	struct tblentry **pp;
 
-	p = name;
-	hashval = *p << 4;
-	while (*p)
-		hashval += *p++;
-	hashval &= 0x7FFF;
-	pp = &cmdtable[hashval % CMDTABLESIZE];
+	hashval = strhash(name, '\0', &len);
+	pp = &cmdtable[hashval & (cmdtablesize - 1)];
 	for (cmdp = *pp ; cmdp ; cmdp = cmdp->next) {
-		if (equal(cmdp->cmdname, name))
+		if (cmdp->hash == hashval && equal(cmdp->cmdname, name))
 			break;
 		pp = &cmdp->next;
 	}
 	if (add && cmdp == NULL) {
 		INTOFF;
+		if (ncmds >= cmdtablesize) {
+			growcmdtable();
+			pp = &cmdtable[hashval & (cmdtablesize - 1)];
+			while (*pp != NULL)
+				pp = &(*pp)->next;
+		}
 		cmdp = *pp = ckmalloc(sizeof (struct tblentry) - ARB
-					+ strlen(name) + 1);
+					+ len + 1);
 		cmdp->next = NULL;
 		cmdp->cmdtype = CMDUNKNOWN;
 		cmdp->rehash = 0;
+		cmdp->gen = 0;		/* not a "not found" entry (yet) */
+		cmdp->hash = hashval;
 		strcpy(cmdp->cmdname, name);
+		ncmds++;
 		INTON;
 	}
 	lastcmdentry = pp;
 	return cmdp;
 }
 
+/*
+ * Double the number of hash chains.  If we cannot get the memory, we
+ * just go on using the table we have.
+ */
+
+STATIC void
+growcmdtable(void)
+{
+	struct tblentry **ntab;
+	struct tblentry *cmdp, *next;
+	unsigned int nsize = cmdtablesize << 1;
+	unsigned int i;
+
+	/* not ckmalloc() - we want failure, not error() here */
+	ntab = calloc(nsize, sizeof *ntab);
+	if (ntab == NULL)
+		return;
+
+	for (i = 0; i < cmdtablesize; i++) {
+		for (cmdp = cmdtable[i]; cmdp != NULL; cmdp = next) {
+			next = cmdp->next;
+			cmdp->next = ntab[cmdp->hash & (nsize - 1)];
+			ntab[cmdp->hash & (nsize - 1)] = cmdp;
+		}
+	}
+	if (cmdtable != cmdtable_init)
+		free(cmdtable);
+	cmdtable = ntab;
+	cmdtablesize = nsize;
+}
+
 /*
  * Delete the command entry returned on the last lookup.
  */
@@ -955,7 +1173,10 @@ delete_cmd_entry(void)
 	INTOFF;
 	cmdp = *lastcmdentry;
 	*lastcmdentry = cmdp->next;
+	if (NEGENTRY(cmdp))
+		nnegcmds--;
 	ckfree(cmdp);
+	ncmds--;
 	INTON;
 }
 
@@ -993,6 +1214,8 @@ addcmdentry(char *name, struct cmdentry *entry)
 	if (cmdp->cmdtype != CMDSPLBLTIN) {
 		if (cmdp->cmdtype == CMDFUNCTION)
 			unreffunc(cmdp->param.func);
+		else if (NEGENTRY(cmdp))
+			nnegcmds--;
 		cmdp->cmdtype = entry->cmdtype;
 		cmdp->lineno = entry->lineno;
 		cmdp->fn_ln1 = entry->lno_frel;
@@ -1048,7 +1271,6 @@ typecmd(int argc, char **argv)
 {
 	struct cmdentry entry;
 	struct tblentry *cmdp;
-	const char * const *pp;
 	struct alias *ap;
 	int err = 0;
 	char *arg;
@@ -1079,11 +1301,7 @@ typecmd(int argc, char **argv)
 		if (!v_flag)
 			out1str(arg);
 		/* First look at the keywords */
-		for (pp = parsekwd; *pp; pp++)
-			if (**pp == *arg && equal(*pp, arg))
-				break;
-
-		if (*pp) {
+		if (findkwd(arg) != 0) {
 			if (v_flag)
 				out1fmt("%s\n", arg);
 			else
@@ -1110,7 +1328,8 @@ typecmd(int argc, char **argv)
 		}
 
 		/* Then check if it is a tracked alias */
-		if (!p_flag && (cmdp = cmdlookup(arg, 0)) != NULL) {
+		if (!p_flag && (cmdp = cmdlookup(arg, 0)) != NULL &&
+		    cmdp->cmdtype != CMDUNKNOWN) {
 			entry.cmdtype = cmdp->cmdtype;
 			entry.u = cmdp->param;
 		} else {
@@ -62,6 +62,7 @@ struct cmdentry {
 #define DO_ALTBLTIN	0x20	/* %builtin in alt. path */
 
 extern const char *pathopt;	/* set by padvance */
+extern int fschanged;		/* PATH directories may have changed */
 
 void shellexec(char **, char **, const char *, int, int) __dead;
 char *padvance(const char **, const char *, int);
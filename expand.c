@@ -102,6 +102,7 @@ static int empty_dollar_at;	/* have expanded "$@" to nothing */
 STATIC const char *argstr(const char *, int);
 STATIC const char *exptilde(const char *, int);
 STATIC void expbackq(union node *, int, int);
+STATIC char *backqstore(char *, int, const char *);
 STATIC const char *expari(const char *);
 STATIC int subevalvar(const char *, const char *, int, int, int);
 STATIC int subevalvar_trim(const char *, int, int, int, int, int);
@@ -116,8 +117,12 @@ STATIC void expandmeta(struct strlist *, int);
 STATIC void expmeta(char *, char *);
 STATIC void addfname(char *);
 STATIC struct strlist *expsort(struct strlist *);
-STATIC struct strlist *msort(struct strlist *, int);
+STATIC int expcmp(const void *, const void *);
+struct patprog;
 STATIC int patmatch(const char *, const char *, int);
+STATIC int classmatch(const char *, unsigned char, const char **);
+STATIC struct patprog *patcompile(const char *);
+STATIC int pmatch(const struct patprog *, const char *, int);
 STATIC char *cvtnum(int, char *);
 static int collate_range_cmp(wchar_t, wchar_t);
 STATIC void add_args(struct strlist *);
@@ -152,6 +157,74 @@ expandhere(union node *arg, int fd)
 	xwrite(fd, stackblock(), expdest - stackblock());
 }
 
+/*
+ * Expand a here document onto the stack (at stackblock()) in this
+ * shell, rather than in a subshell as expandhere() is used, returning
+ * its length.  That can only be done if the expansions cannot assign
+ * variables, or run commands: if not, -1 is returned.  An error
+ * leaves the document empty (a subshell would have written whatever
+ * it had expanded and flushed before the error).
+ */
+
+int
+expandheredoc(union node *arg)
+{
+	struct jmploc jmploc;
+	struct jmploc *const savehandler = handler;
+	const int saveint = suppressint;
+	const char *p;
+	int ari = 0;
+	int len;
+
+	if (arg->narg.backquote != NULL)
+		return -1;
+	for (p = arg->narg.text; *p != '\0'; p++) {
+		switch (*p) {
+		case CTLESC:
+			if (*++p == '\0')
+				p--;
+			break;
+		case CTLBACKQ:
+		case CTLBACKQ | CTLQUOTE:
+			return -1;
+		case CTLVAR:
+			if ((*++p & VSTYPE) == VSASSIGN)
+				return -1;
+			break;
+		case CTLARI:
+			ari++;
+			break;
+		case CTLENDARI:
+			ari--;
+			break;
+		case '=':
+			if (ari > 0)
+				return -1;
+			break;
+		case '+':
+		case '-':
+			if (ari > 0 && p[1] == *p)
+				return -1;
+			break;
+		}
+	}
+
+	if (setjmp(jmploc.loc)) {
+		handler = savehandler;
+		suppressint = saveint;
+		herefd = -1;
+		if (exception != EXERROR)
+			longjmp(handler->loc, 1);
+		return 0;
+	}
+	handler = &jmploc;
+	herefd = -1;
+	expandarg(arg, NULL, 0);
+	len = expdest - stackblock();
+	handler = savehandler;
+	return len;
+}
+
 
 static int
 collate_range_cmp(wchar_t c1, wchar_t c2)
@@ -252,7 +325,7 @@ argstr(const char *p, int flag)
 	int ifs_split = EXP_IFS_SPLIT;
 
 	if (flag & EXP_IFS_SPLIT)
-		ifs = ifsval();
+		ifs = ifstable(ifsval());
 
 	CTRACE(DBG_EXPAND, ("argstr(\"%s\", %#x) quotes=%#x\n", p,flag,quotes));
 
@@ -371,7 +444,7 @@ argstr(const char *p, int flag)
 			if (c == '\n')
 				line_number++;
 			STPUTC(c, expdest);
-			if (flag & ifs_split && strchr(ifs, c) != NULL) {
+			if (flag & ifs_split && IFS_CLASS(ifs, c) & IFS_SEP) {
 				/* We need to get the output split here... */
 				recordregion(expdest - stackblock() - 1,
 						expdest - stackblock(), 0);
@@ -589,6 +662,84 @@ expari(const char *p)
 }
 
 
+/*
+ * What to do with each byte of command substitution output, indexed
+ * by whether it needs escaping for quoting (ie: CTLESC before all that
+ * NEEDESC() rather than just the CTL chars), then the (unsigned) byte.
+ */
+#define	BQ_KEEP	0		/* just store it */
+#define	BQ_DROP	1		/* '\0' */
+#define	BQ_ESC	2		/* store it after a CTLESC */
+
+#define	BACKQMIN 512		/* least we want to read() at once */
+#define	BACKQMAX 65536		/* most we read() at once */
+
+STATIC char backqesc[2][UCHAR_MAX + 1];
+
+#ifdef mkinit
+MKINIT void initbackqesc(void);
+
+INIT {
+	initbackqesc();
+}
+#endif
+
+void
+initbackqesc(void)
+{
+	int i;
+	char c;
+
+	for (i = 0; i <= UCHAR_MAX; i++) {
+		c = (char)i;
+		if (c == '\0')
+			backqesc[0][i] = backqesc[1][i] = BQ_DROP;
+		else {
+			backqesc[0][i] = ISCTL(c) ? BQ_ESC : BQ_KEEP;
+			backqesc[1][i] = NEEDESC(c) || ISCTL(c) ? BQ_ESC :
+			    BQ_KEEP;
+		}
+	}
+}
+
+/*
+ * The n bytes at dest (which has room for 2 * n, and more) were just
+ * placed there from a command substitution.  Drop any \0's and put a
+ * CTLESC before bytes that need one, as the table esc says.  All of
+ * the data usually just stays where it is.  If something needs doing,
+ * the rest of it is moved to the end of the space, and then copied
+ * back.  Returns the new end of the stack string.
+ */
+
+STATIC char *
+backqstore(char *dest, int n, const char *esc)
+{
+	char *q = dest;
+	char *r;
+	char *end = dest + n;
+
+	while (q < end && esc[(unsigned char)*q] == BQ_KEEP)
+		q++;
+	if (q < end) {
+		r = dest + 2 * n - (end - q);
+		memmove(r, q, end - q);
+		for (end = dest + 2 * n; r < end; r++) {
+			switch (esc[(unsigned char)*r]) {
+			case BQ_DROP:
+				continue;
+			case BQ_ESC:
+				*q++ = CTLESC;
+				break;
+			}
+			*q++ = *r;
+		}
+	}
+	n = q - dest;
+	STADJUST(n, dest);
+	return dest;
+}
+
+
 /*
  * Expand stuff in backwards quotes (these days, any command substitution).
  */
@@ -598,16 +749,14 @@ expbackq(union node *cmd, int quoted, int flag)
 {
 	struct backcmd in;
 	int i;
-	char buf[128];
 	char *p;
 	char *dest = expdest;	/* expdest may be reused by eval, use an alt */
 	struct ifsregion saveifs, *savelastp;
 	struct nodelist *saveargbackq;
-	char lastc;
 	int startloc = dest - stackblock();
 	int saveherefd;
 	const int quotes = flag & EXP_QNEEDED;
-	int nnl;
+	const char *esc;
 	struct stackmark smark;
 
 	VTRACE(DBG_EXPAND, ("expbackq( ..., q=%d flag=%#x) have %d\n",
@@ -629,65 +778,44 @@ expbackq(union node *cmd, int quoted, int flag)
 	argbackq = saveargbackq;
 	herefd = saveherefd;
 
-	p = in.buf;		/* now extract the results */
-	nnl = 0;		/* dropping trailing \n's */
-	for (;;) {
-		if (--in.nleft < 0) {
-			if (in.fd < 0)
-				break;
-			INTON;
-			while ((i = read(in.fd, buf, sizeof buf)) < 0 && errno == EINTR)
-				continue;
-			INTOFF;
-			VTRACE(DBG_EXPAND, ("expbackq: read returns %d\n", i));
-			if (i <= 0)
-				break;
-			p = buf;
-			in.nleft = i - 1;
+	esc = backqesc[quotes && quoted];
+
+	/* now extract the results: first whatever was captured in memory */
+	for (p = in.buf; in.nleft > 0; p += i, in.nleft -= i) {
+		i = sstrnleft / 2;
+		if (i < BACKQMIN) {
+			dest = makestrspace();
+			i = sstrnleft / 2;
 		}
-		lastc = *p++;
-		if (lastc != '\0') {
-			if (lastc == '\n')	/* don't save \n yet */
-				nnl++;		/* it might be trailing */
-			else {
-				/*
-				 * We have something other than \n
-				 *
-				 * Before saving it, we need to insert
-				 * any \n's that we have just skipped.
-				 */
+		if (i > in.nleft)
+			i = in.nleft;
+		memcpy(dest, p, i);
+		dest = backqstore(dest, i, esc);
+	}
 
-				/* XXX
-				 * this hack is just because our
-				 * CHECKSTRSPACE() is lazy, and only
-				 * ever grows the stack once, even
-				 * if that does not allocate the space
-				 * we requested.  ie: safe for small
-				 * requests, but not large ones.
-				 * FIXME someday...
-				 */
-				if (nnl < 20) {
-					CHECKSTRSPACE(nnl + 2, dest);
-					while (nnl > 0) {
-						nnl--;
-						USTPUTC('\n', dest);
-					}
-				} else {
-					/* The slower, safer, way */
-					while (nnl > 0) {
-						nnl--;
-						STPUTC('\n', dest);
-					}
-					CHECKSTRSPACE(2, dest);
-				}
-				if ((quotes && quoted && NEEDESC(lastc)) ||
-				    ISCTL(lastc))
-					USTPUTC(CTLESC, dest);
-				USTPUTC(lastc, dest);
-			}
+	/* and then read the rest (if any) straight into the stack string */
+	while (in.fd >= 0) {
+		i = sstrnleft / 2;
+		if (i < BACKQMIN) {
+			dest = makestrspace();
+			i = sstrnleft / 2;
 		}
+		if (i > BACKQMAX)
+			i = BACKQMAX;
+		INTON;
+		while ((i = read(in.fd, dest, i)) < 0 && errno == EINTR)
+			continue;
+		INTOFF;
+		VTRACE(DBG_EXPAND, ("expbackq: read returns %d\n", i));
+		if (i <= 0)
+			break;
+		dest = backqstore(dest, i, esc);
 	}
 
+	/* drop trailing \n's (which are never escaped) */
+	while (dest > stackblock() + startloc && dest[-1] == '\n')
+		STUNPUTC(dest);
+
 	if (in.fd >= 0)
 		close(in.fd);
 	if (in.buf)
@@ -757,6 +885,7 @@ subevalvar_trim(const char *p, int strloc, int subtype, int startloc,
 	char *loc = NULL;
 	char *q;
 	int c = 0;
+	struct patprog *pp;
 	int saveherefd = herefd;
 	struct nodelist *saveargbackq = argbackq;
 	int amount;
@@ -783,6 +912,7 @@ subevalvar_trim(const char *p, int strloc, int subtype, int startloc,
 	argbackq = saveargbackq;
 	startp = stackblock() + startloc;
 	str = stackblock() + strloc;
+	pp = patcompile(str);
 
 	switch (subtype) {
 
@@ -790,7 +920,7 @@ subevalvar_trim(const char *p, int strloc, int subtype, int startloc,
 		for (loc = startp; loc < str; loc++) {
 			c = *loc;
 			*loc = '\0';
-			if (patmatch(str, startp, quotes))
+			if (pmatch(pp, startp, quotes))
 				goto recordleft;
 			*loc = c;
 			if (quotes && *loc == CTLESC)
@@ -802,7 +932,7 @@ subevalvar_trim(const char *p, int strloc, int subtype, int startloc,
 		for (loc = str - 1; loc >= startp;) {
 			c = *loc;
 			*loc = '\0';
-			if (patmatch(str, startp, quotes))
+			if (pmatch(pp, startp, quotes))
 				goto recordleft;
 			*loc = c;
 			loc--;
@@ -819,7 +949,7 @@ subevalvar_trim(const char *p, int strloc, int subtype, int startloc,
 
 	case VSTRIMRIGHT:
 		for (loc = str - 1; loc >= startp;) {
-			if (patmatch(str, loc, quotes))
+			if (pmatch(pp, loc, quotes))
 				goto recordright;
 			loc--;
 			if (quotes && loc > startp &&
@@ -835,7 +965,7 @@ subevalvar_trim(const char *p, int strloc, int subtype, int startloc,
 
 	case VSTRIMRIGHTMAX:
 		for (loc = startp; loc < str - 1; loc++) {
-			if (patmatch(str, loc, quotes))
+			if (pmatch(pp, loc, quotes))
 				goto recordright;
 			if (quotes && *loc == CTLESC)
 				loc++;
@@ -1327,6 +1457,44 @@ recordregion(int start, int end, int inquotes)
 
 
 
+/*
+ * Return the table which classifies each char for field splitting
+ * (IFS_SEP etc, see expand.h) using the given IFS value.  The table
+ * for the last IFS seen is kept, so this only rebuilds it when IFS
+ * has changed.  Note that \0 counts as IFS white space (as it is
+ * always found by strchr(ifs, c), which is what this replaces).
+ */
+
+const char *
+ifstable(const char *ifs)
+{
+	static char ifsclass[UCHAR_MAX + 1];
+	static char lastifs[16];
+	static int valid;
+	const char *p;
+	int c;
+
+	if (valid && strcmp(ifs, lastifs) == 0)
+		return ifsclass;
+
+	memset(ifsclass, 0, sizeof ifsclass);
+	for (c = (unsigned char)CTL_FIRST; c <= (unsigned char)CTL_LAST; c++)
+		ifsclass[c] = IFS_CTL;
+	ifsclass[0] = IFS_SEP | IFS_WHITE;
+	for (p = ifs; *p != '\0'; p++) {
+		c = (unsigned char)*p;
+		ifsclass[c] |= IFS_SEP;
+		if (*p == ' ' || *p == '\t' || *p == '\n')
+			ifsclass[c] |= IFS_WHITE;
+	}
+
+	/* an absurdly long IFS just gets rebuilt every time */
+	valid = strlen(ifs) < sizeof lastifs;
+	if (valid)
+		strcpy(lastifs, ifs);
+	return ifsclass;
+}
+
 /*
  * Break the argument string into pieces based upon IFS and add the
  * strings to the argument list.  The regions of the string to be
@@ -1341,7 +1509,8 @@ ifsbreakup(char *string, struct arglist *arglist)
 	char *p;
 	char *q;
 	const char *ifs;
-	const char *ifsspc;
+	char *end;
+	int ifsspc;
 	int had_param_ch = 0;
 
 	start = string;
@@ -1357,13 +1526,32 @@ ifsbreakup(char *string, struct arglist *arglist)
 		return;
 	}
 
-	ifs = ifsval();
+	ifs = ifstable(ifsval());
 
 	for (ifsp = &ifsfirst; ifsp != NULL; ifsp = ifsp->next) {
 		p = string + ifsp->begoff;
+		end = string + ifsp->endoff;
 		VTRACE(DBG_EXPAND, (" !%.*s!(%d)", ifsp->endoff-ifsp->begoff,
 		    p, ifsp->endoff-ifsp->begoff));
-		while (p < string + ifsp->endoff) {
+		while (p < end) {
+			/*
+			 * Skip quickly over the dull chars, those which
+			 * cannot end a field, or need any special handling.
+			 */
+			q = p;
+			if (ifsp->inquotes) {
+				while (p < end && *p != '\0' &&
+				    !(IFS_CLASS(ifs, *p) & IFS_CTL))
+					p++;
+			} else {
+				while (p < end && IFS_CLASS(ifs, *p) == 0)
+					p++;
+			}
+			if (p != q)
+				had_param_ch = 1;
+			if (p >= end)
+				break;
+
 			had_param_ch = 1;
 			q = p;
 			if (IS_BORING(*p)) {
@@ -1378,18 +1566,18 @@ ifsbreakup(char *string, struct arglist *arglist)
 					p++;
 					continue;
 				}
-				ifsspc = NULL;
+				ifsspc = 0;
 				VTRACE(DBG_EXPAND, (" \\0 nxt:\"%s\" ", p));
 			} else {
-				if (!strchr(ifs, *p)) {
+				if (!(IFS_CLASS(ifs, *p) & IFS_SEP)) {
 					p++;
 					continue;
 				}
 				had_param_ch = 0;
-				ifsspc = strchr(" \t\n", *p);
+				ifsspc = IFS_CLASS(ifs, *p) & IFS_WHITE;
 
 				/* Ignore IFS whitespace at start */
-				if (q == start && ifsspc != NULL) {
+				if (q == start && ifsspc) {
 					p++;
 					start = p;
 					continue;
@@ -1405,19 +1593,19 @@ ifsbreakup(char *string, struct arglist *arglist)
 			arglist->lastp = &sp->next;
 			p++;
 
-			if (ifsspc != NULL) {
+			if (ifsspc) {
 				/* Ignore further trailing IFS whitespace */
-				for (; p < string + ifsp->endoff; p++) {
+				for (; p < end; p++) {
 					q = p;
 					if (*p == CTLNONL)
 						continue;
 					if (*p == CTLESC)
 						p++;
-					if (strchr(ifs, *p) == NULL) {
+					if (!(IFS_CLASS(ifs, *p) & IFS_SEP)) {
 						p = q;
 						break;
 					}
-					if (strchr(" \t\n", *p) == NULL) {
+					if (!(IFS_CLASS(ifs, *p) & IFS_WHITE)) {
 						p++;
 						break;
 					}
@@ -1549,6 +1737,7 @@ expmeta(char *enddir, char *name)
 	struct stat statb;
 	DIR *dirp;
 	struct dirent *dp;
+	struct patprog *pp;
 	int atend;
 	int matchdot;
 
@@ -1678,19 +1867,32 @@ expmeta(char *enddir, char *name)
 		p++;
 	if (*p == '.')
 		matchdot++;
+	pp = patcompile(start);
 	while (! int_pending() && (dp = readdir(dirp)) != NULL) {
 		if (dp->d_name[0] == '.' && ! matchdot)
 			continue;
-		if (patmatch(start, dp->d_name, 0)) {
+		if (pmatch(pp, dp->d_name, 0)) {
 			if (atend) {
 				scopy(dp->d_name, enddir);
 				addfname(expdir);
 			} else {
+#ifdef DT_DIR
+				/*
+				 * No point looking inside something that
+				 * we know is not a directory (or symlink).
+				 */
+				if (dp->d_type != DT_DIR &&
+				    dp->d_type != DT_LNK &&
+				    dp->d_type != DT_UNKNOWN)
+					continue;
+#endif
 				for (p = enddir, cp = dp->d_name;
 				     (*p++ = *cp++) != '\0';)
 					continue;
 				p[-1] = '/';
 				expmeta(p, endname);
+				/* that may have replaced our compiled pattern */
+				pp = patcompile(start);
 			}
 		}
 	}
@@ -1720,62 +1922,39 @@ addfname(char *name)
 
 
 /*
- * Sort the results of file name expansion.  It calculates the number of
- * strings to sort and then calls msort (short for merge sort) to do the
- * work.
+ * Sort the results of file name expansion.  The list is put into
+ * an array (on the stack) which qsort() sorts, and is then relinked
+ * in the new order.
  */
 
+STATIC int
+expcmp(const void *a, const void *b)
+{
+	return strcmp((*(struct strlist * const *)a)->text,
+	    (*(struct strlist * const *)b)->text);
+}
+
 STATIC struct strlist *
 expsort(struct strlist *str)
 {
-	int len;
+	int len, i;
 	struct strlist *sp;
+	struct strlist **arr;
 
 	len = 0;
 	for (sp = str ; sp ; sp = sp->next)
 		len++;
-	return msort(str, len);
-}
-
-
-STATIC struct strlist *
-msort(struct strlist *list, int len)
-{
-	struct strlist *p, *q = NULL;
-	struct strlist **lpp;
-	int half;
-	int n;
-
 	if (len <= 1)
-		return list;
-	half = len >> 1;
-	p = list;
-	for (n = half ; --n >= 0 ; ) {
-		q = p;
-		p = p->next;
-	}
-	q->next = NULL;			/* terminate first half of list */
-	q = msort(list, half);		/* sort first half of list */
-	p = msort(p, len - half);		/* sort second half */
-	lpp = &list;
-	for (;;) {
-		if (strcmp(p->text, q->text) < 0) {
-			*lpp = p;
-			lpp = &p->next;
-			if ((p = *lpp) == NULL) {
-				*lpp = q;
-				break;
-			}
-		} else {
-			*lpp = q;
-			lpp = &q->next;
-			if ((q = *lpp) == NULL) {
-				*lpp = p;
-				break;
-			}
-		}
-	}
-	return list;
+		return str;
+
+	arr = stalloc(len * sizeof *arr);
+	for (i = 0, sp = str ; sp ; sp = sp->next)
+		arr[i++] = sp;
+	qsort(arr, len, sizeof *arr, expcmp);
+	for (i = 0 ; i < len - 1 ; i++)
+		arr[i]->next = arr[i + 1];
+	arr[len - 1]->next = NULL;
+	return arr[0];
 }
 
 
@@ -1839,85 +2018,311 @@ match_charclass(const char *p, wchar_t chr, const char **end)
 
 
 /*
- * Returns true if the pattern matches the string.
+ * Patterns are compiled (by patcompile()) into a little program
+ * which pmatch() runs, rather than being interpreted from the text
+ * for every string they are matched against.  The ops are:
+ *
+ *	PC_END			end of the pattern
+ *	PC_LIT n c...		the n (1..255) literal chars c...
+ *	PC_ANY			'?'
+ *	PC_STAR			'*' (any number of them, together)
+ *	PC_CLASS map[32]	'[...]', map has a bit set for each byte
+ *				that the bracket expression matches
+ *
+ * Patterns of the form lit, lit*, *lit and lit*lit (including the empty
+ * literal) are recognised, and (when the string has no CTLESC chars)
+ * matched with simple comparisons instead.
+ */
+#define	PC_END		0
+#define	PC_LIT		1
+#define	PC_ANY		2
+#define	PC_STAR		3
+#define	PC_CLASS	4
+
+#define	PT_PROG		0	/* no short cut, run code[] */
+#define	PT_EXACT	1	/* string must equal the prefix */
+#define	PT_STAR		2	/* prefix, anything, suffix */
+
+struct patprog {
+	int type;		/* PT_* */
+	int prelen;		/* PT_EXACT, PT_STAR: length of prefix */
+	int suflen;		/* PT_STAR: length of suffix */
+	const char *prefix;	/* these point into code[] */
+	const char *suffix;
+	unsigned char code[1];	/* the program */
+};
+
+/*
+ * Compiled patterns are kept, for reuse whenever the same pattern text
+ * is met again (as in a case statement in a loop), in this small
+ * table, indexed by a hash of the pattern.  A new entry replaces
+ * whatever was in its slot.
+ */
+#define	PATCACHESIZE	64	/* must be a power of 2 */
+
+STATIC struct patcache {
+	char *text;		/* the pattern, as passed to patcompile() */
+	unsigned int hash;
+	struct patprog *prog;
+} patcache[PATCACHESIZE];
+
+/*
+ * Decide whether the byte chr is matched by the bracket expression
+ * which starts at p (just after the '[').   Returns -1 if p does
+ * not really start a bracket expression (there is no terminating ']'),
+ * in which case the '[' is just an ordinary char, otherwise sets *endp
+ * to just after the ']', and returns 1 for a match, and 0 for no match.
+ * The result does not depend upon chr, other than the return value.
  */
 
 STATIC int
-patmatch(const char *pattern, const char *string, int squoted)
+classmatch(const char *p, unsigned char chr, const char **endp)
 {
-	const char *p, *q, *end;
-	const char *bt_p, *bt_q;
+	const char *end;
+	int invert, found;
 	char c;
 	wchar_t wc, wc2;
 
-	VTRACE(DBG_MATCH, ("patmatch(P=\"%s\", W=\"%s\"%s): ",
-	    pattern, string, squoted ? ", SQ" : ""));
+	invert = 0;
+	if (*p == '!' || *p == '^') {
+		invert++;
+		p++;
+	}
+	found = 0;
+	c = *p++;
+	do {
+		if (IS_BORING(c))
+			continue;
+		if (c == '\0')
+			return -1;
+		if (c == '[' && *p == ':') {
+			found |= match_charclass(p, chr, &end);
+			if (end != NULL) {
+				p = end;
+				continue;
+			}
+		}
+		if (c == CTLESC || c == '\\')
+			c = *p++;
+		wc = (unsigned char)c;
+		if (*p == '-' && p[1] != ']') {
+			p++;
+			if (*p == CTLESC || *p == '\\')
+				p++;
+			wc2 = (unsigned char)*p++;
+			if (   collate_range_cmp(chr, wc) >= 0
+			    && collate_range_cmp(chr, wc2) <= 0
+			   )
+				found = 1;
+		} else {
+			if (chr == wc)
+				found = 1;
+		}
+	} while ((c = *p++) != ']');
+	*endp = p;
+	return found != invert;
+}
+
+/*
+ * Compile a pattern, or find it already compiled.  The result remains
+ * valid until the next call.
+ */
+
+STATIC struct patprog *
+patcompile(const char *pattern)
+{
+	struct patcache *pc;
+	struct patprog *pp;
+	unsigned char *cp;		/* where the next code byte goes */
+	unsigned char *lit = NULL;	/* the current PC_LIT, if any */
+	unsigned char *star = NULL;	/* just after the last PC_STAR */
+	const char *p, *endp;
+	unsigned int hash;
+	int len, i, r;
+	char c;
+
+	hash = strhash(pattern, '\0', &len);
+	pc = &patcache[hash & (PATCACHESIZE - 1)];
+	if (pc->prog != NULL && pc->hash == hash &&
+	    strcmp(pc->text, pattern) == 0)
+		return pc->prog;
+
+	/* worst case: each char becomes 1/3 of a PC_CLASS, +PC_END */
+	pp = ckmalloc(sizeof(*pp) + 12 * len + 1);
+	cp = pp->code;
 	p = pattern;
+	for (;;) {
+		switch (c = *p++) {
+		case '\0':
+			*cp++ = PC_END;
+			break;
+		case CTLESC:
+			if (*p == '\0')		/* nothing left to escape */
+				continue;
+			c = *p++;
+			goto literal;
+		case '\\':
+			if (*p != '\0')		/* a trailing \ is just itself */
+				c = *p++;
+			goto literal;
+		case CTLQUOTEMARK:
+		case CTLQUOTEEND:
+		case CTLNONL:
+			continue;
+		case '?':
+			*cp++ = PC_ANY;
+			lit = NULL;
+			continue;
+		case '*':
+			if (cp != star) {	/* "**" is just "*" */
+				*cp++ = PC_STAR;
+				star = cp;
+			}
+			lit = NULL;
+			continue;
+		case '[':
+			r = classmatch(p, 0, &endp);
+			if (r == -1)
+				goto literal;	/* not a bracket expression */
+			*cp++ = PC_CLASS;
+			memset(cp, 0, 32);
+			if (r)
+				cp[0] |= 1;
+			for (i = 1; i <= UCHAR_MAX; i++)
+				if (classmatch(p, i, &endp) > 0)
+					cp[i >> 3] |= 1 << (i & 7);
+			cp += 32;
+			p = endp;
+			lit = NULL;
+			continue;
+		default:
+  literal:
+			if (lit == NULL || *lit == 255) {
+				lit = cp;
+				*cp++ = PC_LIT;		/* not op, keep lit */
+				*cp++ = 0;
+				lit++;
+			}
+			(*lit)++;
+			*cp++ = c;
+			continue;
+		}
+		break;
+	}
+
+	/* Look for the shapes we can match without running the program */
+	pp->type = PT_PROG;
+	pp->prelen = pp->suflen = 0;
+	pp->prefix = pp->suffix = "";
+	cp = pp->code;
+	if (*cp == PC_LIT) {
+		pp->prelen = cp[1];
+		pp->prefix = (char *)cp + 2;
+		cp += 2 + cp[1];
+	}
+	if (*cp == PC_END)
+		pp->type = PT_EXACT;
+	else if (*cp == PC_STAR) {
+		cp++;
+		if (*cp == PC_LIT) {
+			pp->suflen = cp[1];
+			pp->suffix = (char *)cp + 2;
+			cp += 2 + cp[1];
+		}
+		if (*cp == PC_END)
+			pp->type = PT_STAR;
+	}
+
+	INTOFF;
+	if (pc->prog != NULL) {
+		ckfree(pc->text);
+		ckfree(pc->prog);
+	}
+	pc->text = savestr(pattern);
+	pc->hash = hash;
+	pc->prog = pp;
+	INTON;
+
+	VTRACE(DBG_MATCH, ("patcompile(\"%s\"): type %d\n",
+	    pattern, pp->type));
+	return pp;
+}
+
+/*
+ * Returns true if the compiled pattern matches the string.  If squoted,
+ * then the string may contain CTLESC chars, which are ignored.
+ */
+
+STATIC int
+pmatch(const struct patprog *pp, const char *string, int squoted)
+{
+	const unsigned char *p;
+	const char *q;
+	const unsigned char *bt_p;
+	const char *bt_q;
+	const unsigned char *lp;
+	unsigned char chr;
+	int n;
+	size_t len;
+
+	if (pp->type != PT_PROG && !(squoted && strchr(string, CTLESC))) {
+		len = strlen(string);
+		if (pp->type == PT_EXACT)
+			return len == (size_t)pp->prelen &&
+			    memcmp(string, pp->prefix, len) == 0;
+		return len >= (size_t)(pp->prelen + pp->suflen) &&
+		    memcmp(string, pp->prefix, pp->prelen) == 0 &&
+		    memcmp(string + len - pp->suflen, pp->suffix,
+			pp->suflen) == 0;
+	}
+
+	p = pp->code;
 	q = string;
 	bt_p = NULL;
 	bt_q = NULL;
 	for (;;) {
-		switch (c = *p++) {
-		case '\0':
+		switch (*p++) {
+		case PC_END:
 			if (squoted && *q == CTLESC) {
 				if (q[1] == '\0')
 					q++;
 			}
 			if (*q != '\0')
 				goto backtrack;
-			VTRACE(DBG_MATCH, ("match\n"));
 			return 1;
-		case CTLESC:
-			if (squoted && *q == CTLESC)
-				q++;
-			if (*p == '\0' && *q == '\0') {
-				VTRACE(DBG_MATCH, ("match-\\\n"));
-				return 1;
+		case PC_LIT:
+			n = *p++;
+			lp = p;
+			p += n;
+			while (--n >= 0) {
+				if (squoted && *q == CTLESC)
+					q++;
+				if (*q++ != (char)*lp++)
+					goto backtrack;
 			}
-			if (*q++ != *p++)
-				goto backtrack;
-			break;
-		case '\\':
-			if (squoted && *q == CTLESC)
-				q++;
-			if (*q++ != *p++)
-				goto backtrack;
 			break;
-		case CTLQUOTEMARK:
-		case CTLQUOTEEND:
-		case CTLNONL:
-			continue;
-		case '?':
+		case PC_ANY:
 			if (squoted && *q == CTLESC)
 				q++;
-			if (*q++ == '\0') {
-				VTRACE(DBG_MATCH, ("?fail\n"));
+			if (*q++ == '\0')
 				return 0;
-			}
 			break;
-		case '*':
-			c = *p;
-			while (c == CTLQUOTEMARK || c == '*')
-				c = *++p;
-			if (c != CTLESC && !IS_BORING(c) &&
-			    c != '?' && c != '*' && c != '[') {
-				while (*q != c) {
+		case PC_STAR:
+			if (*p == PC_END)
+				return 1;
+			if (*p == PC_LIT) {
+				/* skip to where the literal could start */
+				while (*q != (char)p[2]) {
 					if (squoted && *q == CTLESC &&
-					    q[1] == c)
+					    q[1] == (char)p[2])
 						break;
-					if (*q == '\0') {
-						VTRACE(DBG_MATCH, ("*fail\n"));
+					if (*q == '\0')
 						return 0;
-					}
 					if (squoted && *q == CTLESC)
 						q++;
 					q++;
 				}
 			}
-			if (c == CTLESC && p[1] == '\0') {
-				VTRACE(DBG_MATCH, ("match+\\\n"));
-				return 1;
-			}
 			/*
 			 * First try the shortest match for the '*' that
 			 * could work. We can forget any earlier '*' since
@@ -1927,112 +2332,52 @@ patmatch(const char *pattern, const char *string, int squoted)
 			bt_p = p;
 			bt_q = q;
 			break;
-		case '[': {
-			const char *savep, *saveq, *endp;
-			int invert, found;
-			unsigned char chr;
-
-			/*
-			 * First quick check to see if there is a
-			 * possible matching ']' - if not, then this
-			 * is not a char class, and the '[' is just
-			 * a literal '['.
-			 *
-			 * This check will not detect all non classes, but
-			 * that's OK - It just means that we execute the
-			 * harder code sometimes when it it cannot succeed.
-			 */
-			endp = p;
-			if (*endp == '!' || *endp == '^')
-				endp++;
-			for (;;) {
-				while (IS_BORING(*endp))
-					endp++;
-				if (*endp == '\0')
-					goto dft;	/* no matching ] */
-				if (*endp++ == ']')
-					break;
-			}
-			/* end shortcut */
-
-			savep = p, saveq = q;
-			invert = 0;
-			if (*p == '!' || *p == '^') {
-				invert++;
-				p++;
-			}
-			found = 0;
-			if (*q == '\0') {
-				VTRACE(DBG_MATCH, ("[]fail\n"));
+		case PC_CLASS:
+			if (*q == '\0')
 				return 0;
-			}
 			if (squoted && *q == CTLESC)
 				q++;
 			chr = (unsigned char)*q++;
-			c = *p++;
-			do {
-				if (IS_BORING(c))
-					continue;
-				if (c == '\0') {
-					p = savep, q = saveq;
-					c = '[';
-					goto dft;
-				}
-				if (c == '[' && *p == ':') {
-					found |= match_charclass(p, chr, &end);
-					if (end != NULL) {
-						p = end;
-						continue;
-					}
-				}
-				if (c == CTLESC || c == '\\')
-					c = *p++;
-				wc = (unsigned char)c;
-				if (*p == '-' && p[1] != ']') {
-					p++;
-					if (*p == CTLESC || *p == '\\')
-						p++;
-					wc2 = (unsigned char)*p++;
-					if (   collate_range_cmp(chr, wc) >= 0
-					    && collate_range_cmp(chr, wc2) <= 0
-					   )
-						found = 1;
-				} else {
-					if (chr == wc)
-						found = 1;
-				}
-			} while ((c = *p++) != ']');
-			if (found == invert)
+			if ((p[chr >> 3] & (1 << (chr & 7))) == 0) {
+				p += 32;
 				goto backtrack;
-			break;
-		}
-  dft:		default:
-			if (squoted && *q == CTLESC)
-				q++;
-			if (*q++ == c)
-				break;
-  backtrack:
-			/*
-			 * If we have a mismatch (other than hitting the end
-			 * of the string), go back to the last '*' seen and
-			 * have it match one additional character.
-			 */
-			if (bt_p == NULL) {
-				VTRACE(DBG_MATCH, ("BTP fail\n"));
-				return 0;
-			}
-			if (*bt_q == '\0') {
-				VTRACE(DBG_MATCH, ("BTQ fail\n"));
-				return 0;
 			}
-			bt_q++;
-			p = bt_p;
-			q = bt_q;
+			p += 32;
 			break;
+		default:
+			abort();
 		}
+		continue;
+
+  backtrack:
+		/*
+		 * If we have a mismatch (other than hitting the end
+		 * of the string), go back to the last '*' seen and
+		 * have it match one additional character.
+		 */
+		if (bt_p == NULL || *bt_q == '\0')
+			return 0;
+		bt_q++;
+		p = bt_p;
+		q = bt_q;
 	}
 }
 
+/*
+ * Returns true if the pattern matches the string.
+ */
+
+STATIC int
+patmatch(const char *pattern, const char *string, int squoted)
+{
+	int r;
+
+	r = pmatch(patcompile(pattern), string, squoted);
+	VTRACE(DBG_MATCH, ("patmatch(P=\"%s\", W=\"%s\"%s): %s\n",
+	    pattern, string, squoted ? ", SQ" : "", r ? "match" : "fail"));
+	return r;
+}
+
 
 
 /*
@@ -2147,6 +2492,25 @@ casematch(union node *pattern, char *val)
 
 	CTRACE(DBG_MATCH, ("casematch(P=\"%s\", W=\"%s\")\n",
 	    pattern->narg.text, val));
+
+	/*
+	 * If there is nothing in the pattern to expand, the expansion
+	 * would just drop the quote marks, which the pattern compiler
+	 * ignores anyway, so use (the compiled form of) the text as is.
+	 */
+	if (pattern->narg.backquote == NULL && pattern->narg.text[0] != '~') {
+		for (p = pattern->narg.text; *p != '\0'; p++) {
+			if (*p == CTLESC) {
+				if (*++p == '\0')
+					break;
+			} else if (ISCTL(*p) &&
+			    *p != CTLQUOTEMARK && *p != CTLQUOTEEND)
+				break;
+		}
+		if (*p == '\0')
+			return pmatch(patcompile(pattern->narg.text), val, 0);
+	}
+
 	setstackmark(&smark);
 	argbackq = pattern->narg.backquote;
 	STARTSTACKSTR(expdest);
@@ -66,6 +66,15 @@ struct arglist {
 union node;
 
 void expandhere(union node *, int);
+int expandheredoc(union node *);
 void expandarg(union node *, struct arglist *, int);
 void rmescapes(char *);
 int casematch(union node *, char *);
+void initbackqesc(void);
+const char *ifstable(const char *);
+
+/* ifstable() classes, use IFS_CLASS(table, c) */
+#define	IFS_SEP		0x01	/* an IFS character */
+#define	IFS_WHITE	0x02	/* an IFS white space character */
+#define	IFS_CTL		0x04	/* a CTL char, needs a closer look */
+#define	IFS_CLASS(t, c)	((t)[(unsigned char)(c)])
@@ -83,6 +83,8 @@ __RCSID("$NetBSD: jobs.c,v 1.107 2020/02/07 02:06:12 kre Exp $");
 #include "memalloc.h"
 #include "error.h"
 #include "mystring.h"
+#include "exec.h"
+#include "eval.h"
 
 
 #ifndef	WCONTINUED
@@ -95,21 +97,52 @@ __RCSID("$NetBSD: jobs.c,v 1.107 2020/02/07 02:06:12 kre Exp $");
 
 static struct job *jobtab;		/* array of jobs */
 static int njobs;			/* size of array */
+static int *jobslots;			/* heap of unused slots in jobtab */
+static int nslots;			/* number of unused slots */
 static int jobs_invalid;		/* set in child */
 MKINIT pid_t backgndpid = -1;	/* pid of last background process */
+unsigned long nforks;		/* processes forked, for profile */
 #if JOBS
 int initialpgrp;		/* pgrp of shell on invocation */
 static int curjob = -1;		/* current job */
 #endif
 static int ttyfd = -1;
 
+/*
+ * The processes of the jobs in jobtab, hashed by pid, so dowait()
+ * can find the one a status belongs to without searching every job.
+ * Entries hold indexes, as jobtab (and so the ps arrays) can move.
+ * If a pid is reused while the job of the old process still exists,
+ * the entry is for the new process, as the old one can change no more.
+ * Open addressing; deletion moves later entries of the chain back.
+ */
+struct pident {
+	pid_t	pid;		/* process id, 0 if the slot is empty */
+	int	job;		/* index of its job in jobtab */
+	int	proc;		/* index in that job's ps[] */
+};
+STATIC struct pident *pidtab;
+STATIC int pidtabsize;			/* a power of 2, or 0 */
+STATIC int npids;			/* entries in use */
+
+#define	PIDHASH(pid)	(((unsigned int)(pid) * 2654435761U) & (pidtabsize - 1))
+
+STATIC struct pident *pidlookup(pid_t);
+STATIC void pidenter(pid_t, int, int);
+STATIC void piddelete(pid_t, int, int);
+STATIC struct job *setprocstatus(pid_t, int);
+
 STATIC void restartjob(struct job *);
+STATIC void growjobtab(void);
+STATIC void putjobslot(int);
+STATIC int getjobslot(void);
 STATIC void freejob(struct job *);
 STATIC struct job *getjob(const char *, int);
 STATIC int dowait(int, struct job *, struct job **);
 #define WBLOCK	1
 #define WNOFREE 2
 #define WSILENT 4
+STATIC const char *proctext(struct procstat *);
 STATIC int jobstatus(const struct job *, int);
 STATIC int waitproc(int, struct job *, int *);
 STATIC void cmdtxt(union node *);
@@ -264,9 +297,9 @@ do_fgcmd(const char *arg_ptr)
 	jp = getjob(arg_ptr, 0);
 	if (jp->jobctl == 0)
 		error("job not created under job control");
-	out1fmt("%s", jp->ps[0].cmd);
+	out1fmt("%s", proctext(&jp->ps[0]));
 	for (i = 1; i < jp->nprocs; i++)
-		out1fmt(" | %s", jp->ps[i].cmd );
+		out1fmt(" | %s", proctext(&jp->ps[i]));
 	out1c('\n');
 	flushall();
 
@@ -303,20 +336,19 @@ static void
 set_curjob(struct job *jp, int mode)
 {
 	struct job *jp1, *jp2;
-	int i, ji;
+	int ji;
 
 	ji = jp - jobtab;
 
 	/* first remove from list */
-	if (ji == curjob)
-		curjob = jp->prev_job;
-	else {
-		for (i = 0; i < njobs; i++) {
-			if (jobtab[i].prev_job != ji)
-				continue;
-			jobtab[i].prev_job = jp->prev_job;
-			break;
-		}
+	if (ji == curjob || jp->next_job != -1) {
+		if (ji == curjob)
+			curjob = jp->prev_job;
+		else
+			jobtab[jp->next_job].prev_job = jp->prev_job;
+		if (jp->prev_job != -1)
+			jobtab[jp->prev_job].next_job = jp->next_job;
+		jp->next_job = -1;
 	}
 
 	/* Then re-insert in correct position */
@@ -335,12 +367,17 @@ set_curjob(struct job *jp, int mode)
 					break;
 			}
 			jp->prev_job = jp1->prev_job;
+			jp->next_job = jp1 - jobtab;
+			if (jp->prev_job != -1)
+				jobtab[jp->prev_job].next_job = ji;
 			jp1->prev_job = ji;
 			break;
 		}
 		/* FALLTHROUGH */
 	case 2:	/* newly stopped job - becomes curjob */
 		jp->prev_job = curjob;
+		if (curjob != -1)
+			jobtab[curjob].next_job = ji;
 		curjob = ji;
 		break;
 	}
@@ -360,9 +397,10 @@ bgcmd(int argc, char **argv)
 		if (jp->jobctl == 0)
 			error("job not created under job control");
 		set_curjob(jp, 1);
-		out1fmt("[%ld] %s", (long)(jp - jobtab + 1), jp->ps[0].cmd);
+		out1fmt("[%ld] %s", (long)(jp - jobtab + 1),
+		    proctext(&jp->ps[0]));
 		for (i = 1; i < jp->nprocs; i++)
-			out1fmt(" | %s", jp->ps[i].cmd );
+			out1fmt(" | %s", proctext(&jp->ps[i]));
 		out1c('\n');
 		flushall();
 		restartjob(jp);
@@ -510,7 +548,7 @@ showjob(struct output *out, struct job *jp, int mode)
 			outc(' ', out);
 			col++;
 		} while (col < 30);
-		outstr(ps->cmd, out);
+		outstr(proctext(ps), out);
 		if (mode & SHOW_MULTILINE) {
 			if (procno > 0) {
 				outc(' ', out);
@@ -518,7 +556,7 @@ showjob(struct output *out, struct job *jp, int mode)
 			}
 		} else {
 			while (--procno >= 0)
-				outfmt(out, " | %s", (++ps)->cmd );
+				outfmt(out, " | %s", proctext(++ps));
 		}
 		outc('\n', out);
 	}
@@ -614,16 +652,23 @@ showjobs(struct output *out, int mode)
 STATIC void
 freejob(struct job *jp)
 {
+	int i;
+
 	INTOFF;
+	for (i = 0; i < jp->nprocs; i++)
+		piddelete(jp->ps[i].pid, jp - jobtab, i);
 	if (jp->ps != &jp->ps0) {
 		ckfree(jp->ps);
 		jp->ps = &jp->ps0;
 	}
 	jp->nprocs = 0;
-	jp->used = 0;
 #if JOBS
 	set_curjob(jp, 0);
 #endif
+	if (jp->used) {
+		jp->used = 0;
+		putjobslot(jp - jobtab);
+	}
 	INTON;
 }
 
@@ -1000,8 +1045,8 @@ getjob(const char *name, int noerror)
 				if (!jp->used || jp->nprocs <= 0)
 					continue;
 				if ((name[1] == '?'
-					&& strstr(jp->ps[0].cmd, name + 2))
-				    || prefix(name + 1, jp->ps[0].cmd)) {
+					&& strstr(proctext(&jp->ps[0]), name + 2))
+				    || prefix(name + 1, proctext(&jp->ps[0]))) {
 					if (found) {
 						err_msg = "%s: ambiguous";
 						found = 0;
@@ -1015,7 +1060,17 @@ getjob(const char *name, int noerror)
 		}
 
 	} else if (is_number(name)) {
+		struct pident *pe;
+
 		pid = number(name);
+		/*
+		 * Every process of every job is in the index, unless
+		 * its pid has been reused, and then that is what we find.
+		 */
+		if ((pe = pidlookup(pid)) == NULL)
+			goto out;
+		if (pe->proc == jobtab[pe->job].nprocs - 1)
+			return jobtab + pe->job;
 		for (jp = jobtab, i = njobs ; --i >= 0 ; jp++) {
 			if (jp->used && jp->nprocs > 0
 			 && jp->ps[jp->nprocs - 1].pid == pid)
@@ -1028,6 +1083,7 @@ getjob(const char *name, int noerror)
 		if (jp->used)
 			return jp;
 	}
+ out:
 	if (!noerror)
 		error(err_msg, name);
 	return 0;
@@ -1053,33 +1109,10 @@ makejob(union node *node, int nprocs)
 		jobs_invalid = 0;
 	}
 
-	for (i = njobs, jp = jobtab ; ; jp++) {
-		if (--i < 0) {
-			INTOFF;
-			if (njobs == 0) {
-				jobtab = ckmalloc(4 * sizeof jobtab[0]);
-			} else {
-				jp = ckmalloc((njobs + 4) * sizeof jobtab[0]);
-				memcpy(jp, jobtab, njobs * sizeof jp[0]);
-				/* Relocate `ps' pointers */
-				for (i = 0; i < njobs; i++)
-					if (jp[i].ps == &jobtab[i].ps0)
-						jp[i].ps = &jp[i].ps0;
-				ckfree(jobtab);
-				jobtab = jp;
-			}
-			jp = jobtab + njobs;
-			for (i = 4 ; --i >= 0 ; njobs++) {
-				jobtab[njobs].used = 0;
-				jobtab[njobs].prev_job = -1;
-			}
-			INTON;
-			break;
-		}
-		if (jp->used == 0)
-			break;
-	}
 	INTOFF;
+	if (nslots == 0)
+		growjobtab();
+	jp = jobtab + getjobslot();
 	jp->state = JOBRUNNING;
 	jp->used = 1;
 	jp->flags = pipefail ? JPIPEFAIL : 0;
@@ -1101,6 +1134,84 @@ makejob(union node *node, int nprocs)
 }
 
 
+/*
+ * Double the size of the job table (which also relocates the
+ * `ps' pointers of single process jobs), adding the new slots to the
+ * heap of unused ones.
+ */
+
+STATIC void
+growjobtab(void)
+{
+	struct job *jp;
+	int i, n;
+
+	n = njobs ? njobs * 2 : 4;
+	jp = ckmalloc(n * sizeof jobtab[0]);
+	if (njobs != 0) {
+		memcpy(jp, jobtab, njobs * sizeof jp[0]);
+		for (i = 0; i < njobs; i++)
+			if (jp[i].ps == &jobtab[i].ps0)
+				jp[i].ps = &jp[i].ps0;
+		ckfree(jobtab);
+	}
+	jobtab = jp;
+	if (jobslots != NULL)
+		ckfree(jobslots);
+	jobslots = ckmalloc(n * sizeof jobslots[0]);
+	for (i = njobs; i < n; i++) {
+		jobtab[i].used = 0;
+		jobtab[i].ps = &jobtab[i].ps0;
+		jobtab[i].nprocs = 0;
+#if JOBS
+		jobtab[i].prev_job = -1;
+		jobtab[i].next_job = -1;
+#endif
+		/* all in use before, so these are in heap order */
+		jobslots[nslots++] = i;
+	}
+	njobs = n;
+}
+
+/*
+ * The unused slots are kept in a heap, so a new job always gets the
+ * lowest free job number, as it did when the table was searched.
+ */
+
+STATIC void
+putjobslot(int slot)
+{
+	int i, parent;
+
+	for (i = nslots++; i > 0; i = parent) {
+		parent = (i - 1) / 2;
+		if (jobslots[parent] < slot)
+			break;
+		jobslots[i] = jobslots[parent];
+	}
+	jobslots[i] = slot;
+}
+
+STATIC int
+getjobslot(void)
+{
+	int slot, last;
+	int i, child;
+
+	slot = jobslots[0];
+	last = jobslots[--nslots];
+	for (i = 0; (child = 2 * i + 1) < nslots; i = child) {
+		if (child + 1 < nslots && jobslots[child + 1] < jobslots[child])
+			child++;
+		if (last < jobslots[child])
+			break;
+		jobslots[i] = jobslots[child];
+	}
+	jobslots[i] = last;
+	return slot;
+}
+
+
 /*
  * Fork off a subshell.  If we are doing job control, give the subshell its
  * own process group.  Jp is a job structure that the job is to be added to.
@@ -1129,6 +1240,8 @@ forkshell(struct job *jp, union node *n, int mode)
 	case -1:
 		serrno = errno;
 		VTRACE(DBG_JOBS, ("Fork failed, errno=%d\n", serrno));
+		if (jp != NULL)
+			jobtext(jp);
 		error("Cannot fork (%s)", strerror(serrno));
 		break;
 	case 0:
@@ -1156,13 +1269,27 @@ forkparent(struct job *jp, union node *n, int mode, pid_t pid)
 	}
 	if (mode == FORK_BG)
 		backgndpid = pid;		/* set $! */
+	fschanged = 1;			/* the child can alter anything */
+	nforks++;
+	EVTRACE(EVT_FORK, pid, mode, NULL);
 	if (jp) {
-		struct procstat *ps = &jp->ps[jp->nprocs++];
+		struct procstat *ps = &jp->ps[jp->nprocs];
+
+		pidenter(pid, jp - jobtab, jp->nprocs++);
 		ps->pid = pid;
 		ps->status = -1;
 		ps->cmd[0] = 0;
-		if (/* iflag && rootshell && */ n)
+		ps->cmdnode = NULL;
+		if (n == NULL)
+			;
+		else if (iflag || mode == FORK_BG
+#if JOBS
+		    || jp->jobctl
+#endif
+		    )
 			commandtext(ps, n);
+		else
+			ps->cmdnode = n;	/* see jobtext() */
 	}
 	CTRACE(DBG_JOBS, ("In parent shell: child = %d (mode %d)\n",pid,mode));
 	return pid;
@@ -1183,6 +1310,11 @@ forkchild(struct job *jp, union node *n, int mode, int vforked)
 	if (!vforked) {
 		rootshell = 0;
 		handler = &main_handler;
+		forcelocal = 0;
+#ifndef SMALL
+		evtrace_fork();
+		profiling = 0;		/* what it finds goes when it exits */
+#endif
 	}
 
 	closescript(vforked);
@@ -1315,7 +1447,11 @@ waitforjob(struct job *jp)
 
 
 /*
- * Wait for a process to terminate.
+ * Wait for a process to terminate.  Having got one, also collect the
+ * status of any others which have changed, as long as that does not
+ * need to block, so a job of many processes, or many jobs finishing
+ * together, need not come back here for each.  (Not for wait, which
+ * wants to know which job it was, so it gets one at a time.)
  */
 
 STATIC int
@@ -1323,11 +1459,8 @@ dowait(int flags, struct job *job, struct job **changed)
 {
 	int pid;
 	int status;
-	struct procstat *sp;
-	struct job *jp;
+	int first;
 	struct job *thisjob;
-	int done;
-	int stopped;
 
 	VTRACE(DBG_JOBS|DBG_PROCS, ("dowait(%x) called\n", flags));
 
@@ -1341,75 +1474,200 @@ dowait(int flags, struct job *job, struct job **changed)
 	} while (pid == -1 && errno == EINTR && pendingsigs == 0);
 	if (pid <= 0)
 		return pid;
+	fschanged = 1;		/* whatever it did, it has now done */
 	INTOFF;
-	thisjob = NULL;
-	for (jp = jobtab ; jp < jobtab + njobs ; jp++) {
-		if (jp->used) {
-			done = 1;
-			stopped = 1;
-			for (sp = jp->ps ; sp < jp->ps + jp->nprocs ; sp++) {
-				if (sp->pid == -1)
-					continue;
-				if (sp->pid == pid &&
-				  (sp->status==-1 || WIFSTOPPED(sp->status))) {
-					VTRACE(DBG_JOBS | DBG_PROCS,
-			("Job %d: changing status of proc %d from %#x to %#x\n",
-						jp - jobtab + 1, pid,
-						sp->status, status));
-					if (WIFCONTINUED(status)) {
-						if (sp->status != -1)
-							jp->flags |= JOBCHANGED;
-						sp->status = -1;
-						jp->state = 0;
-					} else
-						sp->status = status;
-					thisjob = jp;
-					if (changed != NULL)
-						*changed = jp;
-				}
-				if (sp->status == -1)
-					stopped = 0;
-				else if (WIFSTOPPED(sp->status))
-					done = 0;
-			}
-			if (stopped) {		/* stopped or done */
-				int state = done ? JOBDONE : JOBSTOPPED;
-
-				if (jp->state != state) {
-					VTRACE(DBG_JOBS,
-				("Job %d: changing state from %d to %d\n",
-					    jp - jobtab + 1, jp->state, state));
-					jp->state = state;
-#if JOBS
-					if (done)
-						set_curjob(jp, 0);
-#endif
-				}
+	first = pid;
+	for (;;) {
+		EVTRACE(EVT_WAIT, pid, status, NULL);
+		thisjob = setprocstatus(pid, status);
+		if (changed != NULL)
+			*changed = thisjob;
+
+		if (thisjob && (thisjob->state != JOBRUNNING ||
+		    thisjob->flags & JOBCHANGED)) {
+			int mode = 0;
+
+			if (!rootshell || !iflag)
+				mode = SHOW_SIGNALLED;
+			if ((job == thisjob && (flags & WNOFREE) == 0) ||
+			    job != thisjob)
+				mode = SHOW_SIGNALLED | SHOW_NO_FREE;
+			if (mode && (flags & WSILENT) == 0)
+				showjob(out2, thisjob, mode);
+			else {
+				VTRACE(DBG_JOBS,
+				    ("Not printing status, rootshell=%d, "
+				    "job=%p\n", rootshell, job));
+				thisjob->flags |= JOBCHANGED;
 			}
 		}
+
+		if (changed != NULL ||
+		    (pid = waitproc(0, job, &status)) <= 0)
+			break;
+		VTRACE(DBG_JOBS|DBG_PROCS, ("wait also returns pid %d, "
+		    "status %#x\n", pid, status));
 	}
 
-	if (thisjob &&
-	    (thisjob->state != JOBRUNNING || thisjob->flags & JOBCHANGED)) {
-		int mode = 0;
-
-		if (!rootshell || !iflag)
-			mode = SHOW_SIGNALLED;
-		if ((job == thisjob && (flags & WNOFREE) == 0) ||
-		    job != thisjob)
-			mode = SHOW_SIGNALLED | SHOW_NO_FREE;
-		if (mode && (flags & WSILENT) == 0)
-			showjob(out2, thisjob, mode);
-		else {
+	INTON;
+	return first;
+}
+
+/*
+ * Record the status of a process from wait, and work out from it the
+ * state of its job, which is returned (NULL if the process belongs to
+ * no job we know).
+ */
+
+STATIC struct job *
+setprocstatus(pid_t pid, int status)
+{
+	struct pident *pe;
+	struct procstat *sp;
+	struct job *jp;
+	int done;
+	int stopped;
+
+	if ((pe = pidlookup(pid)) == NULL)
+		return NULL;
+	jp = jobtab + pe->job;
+	sp = &jp->ps[pe->proc];
+	if (!jp->used || sp->pid != pid ||
+	    (sp->status != -1 && !WIFSTOPPED(sp->status)))
+		return NULL;
+
+	VTRACE(DBG_JOBS | DBG_PROCS,
+	    ("Job %d: changing status of proc %d from %#x to %#x\n",
+	    jp - jobtab + 1, pid, sp->status, status));
+	if (WIFCONTINUED(status)) {
+		if (sp->status != -1)
+			jp->flags |= JOBCHANGED;
+		sp->status = -1;
+		jp->state = 0;
+	} else
+		sp->status = status;
+
+	done = 1;
+	stopped = 1;
+	for (sp = jp->ps ; sp < jp->ps + jp->nprocs ; sp++) {
+		if (sp->pid == -1)
+			continue;
+		if (sp->status == -1)
+			stopped = 0;
+		else if (WIFSTOPPED(sp->status))
+			done = 0;
+	}
+	if (stopped) {		/* stopped or done */
+		int state = done ? JOBDONE : JOBSTOPPED;
+
+		if (jp->state != state) {
 			VTRACE(DBG_JOBS,
-			    ("Not printing status, rootshell=%d, job=%p\n",
-			    rootshell, job));
-			thisjob->flags |= JOBCHANGED;
+			    ("Job %d: changing state from %d to %d\n",
+			    jp - jobtab + 1, jp->state, state));
+			jp->state = state;
+#if JOBS
+			if (done)
+				set_curjob(jp, 0);
+#endif
 		}
 	}
+	return jp;
+}
 
+/*
+ * Find the entry for pid in the process index, or NULL.
+ */
+
+STATIC struct pident *
+pidlookup(pid_t pid)
+{
+	struct pident *pe;
+	unsigned int h;
+
+	if (npids == 0)
+		return NULL;
+	for (h = PIDHASH(pid); (pe = &pidtab[h])->pid != 0;
+	    h = (h + 1) & (pidtabsize - 1))
+		if (pe->pid == pid)
+			return pe;
+	return NULL;
+}
+
+/*
+ * Add process proc of job to the index, replacing any earlier
+ * process with the same pid.
+ */
+
+STATIC void
+pidenter(pid_t pid, int job, int proc)
+{
+	struct pident *pe, *old;
+	int oldsize;
+	unsigned int h;
+
+	INTOFF;
+	if ((pe = pidlookup(pid)) == NULL) {
+		if ((npids + 1) * 2 > pidtabsize) {
+			old = pidtab;
+			oldsize = pidtabsize;
+			pidtabsize = oldsize ? oldsize * 2 : 32;
+			pidtab = ckmalloc(pidtabsize * sizeof *pidtab);
+			memset(pidtab, 0, pidtabsize * sizeof *pidtab);
+			for (pe = old; pe < old + oldsize; pe++) {
+				if (pe->pid == 0)
+					continue;
+				for (h = PIDHASH(pe->pid); pidtab[h].pid != 0;
+				    h = (h + 1) & (pidtabsize - 1))
+					continue;
+				pidtab[h] = *pe;
+			}
+			if (old != NULL)
+				ckfree(old);
+		}
+		for (h = PIDHASH(pid); pidtab[h].pid != 0;
+		    h = (h + 1) & (pidtabsize - 1))
+			continue;
+		pe = &pidtab[h];
+		pe->pid = pid;
+		npids++;
+	}
+	pe->job = job;
+	pe->proc = proc;
 	INTON;
-	return pid;
+}
+
+/*
+ * Remove process proc of job from the index, unless the entry for
+ * its pid is for some later process.
+ */
+
+STATIC void
+piddelete(pid_t pid, int job, int proc)
+{
+	struct pident *pe;
+	unsigned int h, i, k;
+
+	if ((pe = pidlookup(pid)) == NULL || pe->job != job ||
+	    pe->proc != proc)
+		return;
+
+	/*
+	 * Empty the slot, then move back any entry after it in the
+	 * chain whose home slot is not between the hole and itself.
+	 */
+	i = pe - pidtab;
+	pidtab[i].pid = 0;
+	npids--;
+	for (h = (i + 1) & (pidtabsize - 1); pidtab[h].pid != 0;
+	    h = (h + 1) & (pidtabsize - 1)) {
+		k = PIDHASH(pidtab[h].pid);
+		if (((h - k) & (pidtabsize - 1)) >=
+		    ((h - i) & (pidtabsize - 1))) {
+			pidtab[i] = pidtab[h];
+			pidtab[h].pid = 0;
+			i = h;
+		}
+	}
 }
 
 
@@ -1511,6 +1769,37 @@ stoppedjobs(void)
 	return (0);
 }
 
+/*
+ * Making the text of each command run in a job, which hardly any
+ * script will ever look at, is put off until it is wanted, when
+ * that is safe.  That is for a foreground job in a shell which is
+ * not interactive and not doing job control, as the tree the text
+ * comes from lasts until the job has been waited for (and freed).
+ * The exception is a job which may outlast its tree, when it has
+ * been abandoned after an error, or when the shell runs commands of
+ * its own before it waits for it (lastpipe): jobtext() is called
+ * for those, and makes the text for all of its processes at once.
+ */
+
+void
+jobtext(struct job *jp)
+{
+	int i;
+
+	for (i = 0; i < jp->nprocs; i++)
+		(void)proctext(&jp->ps[i]);
+}
+
+STATIC const char *
+proctext(struct procstat *ps)
+{
+	if (ps->cmdnode != NULL) {
+		commandtext(ps, ps->cmdnode);
+		ps->cmdnode = NULL;
+	}
+	return ps->cmd;
+}
+
 /*
  * Return a string identifying a command (to be printed by the
  * jobs command).
@@ -63,6 +63,7 @@ struct procstat {
 	pid_t	pid;		/* process id */
  	int	status;		/* last process status from wait() */
  	char	cmd[MAXCMDTEXT];/* text of command being run */
+	union node *cmdnode;	/* or the tree to make it from, see jobtext() */
 };
 
 struct job {
@@ -83,10 +84,12 @@ struct job {
 #if JOBS
 	char 	jobctl;		/* job running under job control */
 	int	prev_job;	/* previous job index */
+	int	next_job;	/* next job index (towards curjob) */
 #endif
 };
 
 extern pid_t backgndpid;	/* pid of last background process */
+extern unsigned long nforks;	/* processes forked, for profile */
 extern int job_warning;		/* user was warned about stopped jobs */
 
 void setjobctl(int);
@@ -98,6 +101,7 @@ int forkparent(struct job *, union node *, int, pid_t);
 int waitforjob(struct job *);
 int stoppedjobs(void);
 void commandtext(struct procstat *, union node *);
+void jobtext(struct job *);
 int getjobpgrp(const char *);
 
 #if ! JOBS
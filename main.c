@@ -298,6 +298,7 @@ cmdloop(int top)
 			chkmail(0);
 			flushout(&errout);
 			nflag = 0;
+			fschanged = 1;	/* anything may happen while we wait */
 		}
 		n = parsecmd(inter);
 		VXTRACE(DBG_PARSE|DBG_EVAL|DBG_CMDS,("cmdloop: "),showtree(n));
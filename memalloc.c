@@ -50,6 +50,8 @@ __RCSID("$NetBSD: memalloc.c,v 1.33 2019/02/09 03:35:55 kre Exp $");
 #include "error.h"
 #include "machdep.h"
 #include "mystring.h"
+#include "options.h"
+#include "builtins.h"
 
 /*
  * Like malloc, but returns an error when out of space.
@@ -109,10 +111,26 @@ savestr(const char *s)
 
 struct stack_block {
 	struct stack_block *prev;
+	size_t size;
 	char space[MINSIZE];
 };
 
-struct stack_block stackbase;
+#define STBLOCKHDR	(sizeof(struct stack_block) - MINSIZE)
+
+/*
+ * Blocks popped off the stack are not handed back to malloc straight
+ * away.  They are kept on a freelist per size class, where class n
+ * holds blocks with (STMINBLOCK << n) bytes of space, so that the next
+ * command which needs the stack usually finds a block ready.  At most
+ * STFREEMAX bytes are kept; anything beyond that high water mark, and
+ * any block too big for the largest class, is freed.
+ */
+
+#define STMINBLOCK	512
+#define STNCLASS	16
+#define STFREEMAX	(256 * 1024)
+
+struct stack_block stackbase = { NULL, MINSIZE };
 struct stack_block *stackp = &stackbase;
 struct stackmark *markp;
 char *stacknxt = stackbase.space;
@@ -120,6 +138,87 @@ int stacknleft = MINSIZE;
 int sstrnleft;
 int herefd = -1;
 
+STATIC struct stack_block *stfree[STNCLASS];
+STATIC size_t stfreebytes;
+
+STATIC struct {
+	unsigned long mallocs;		/* blocks obtained from malloc */
+	unsigned long reuses;		/* blocks taken from the freelist */
+	unsigned long retires;		/* blocks put on the freelist */
+	unsigned long frees;		/* blocks returned to malloc */
+	size_t inuse;			/* block space now on the stack */
+	size_t peak;			/* largest value of inuse */
+} ststat;
+
+STATIC int stclass(int);
+STATIC struct stack_block *stnewblock(int);
+STATIC void stretire(struct stack_block *);
+
+/*
+ * Return the size class for a block with at least nbytes of space,
+ * or -1 if it is too big to be pooled.
+ */
+STATIC int
+stclass(int nbytes)
+{
+	int c;
+
+	for (c = 0; c < STNCLASS; c++)
+		if (nbytes <= (STMINBLOCK << c))
+			return c;
+	return -1;
+}
+
+/*
+ * Get a block with at least nbytes of space, from the freelist if
+ * one is there.  Called with interrupts off.
+ */
+STATIC struct stack_block *
+stnewblock(int nbytes)
+{
+	struct stack_block *sp;
+	int c;
+
+	c = stclass(nbytes);
+	if (c >= 0 && (sp = stfree[c]) != NULL) {
+		stfree[c] = sp->prev;
+		stfreebytes -= sp->size;
+		ststat.reuses++;
+	} else {
+		if (c >= 0)
+			nbytes = STMINBLOCK << c;
+		sp = ckmalloc(STBLOCKHDR + nbytes);
+		sp->size = nbytes;
+		ststat.mallocs++;
+	}
+	ststat.inuse += sp->size;
+	if (ststat.inuse > ststat.peak)
+		ststat.peak = ststat.inuse;
+	return sp;
+}
+
+/*
+ * Take a block off the stack for good.  Called with interrupts off.
+ */
+STATIC void
+stretire(struct stack_block *sp)
+{
+	int c;
+
+	ststat.inuse -= sp->size;
+	c = stclass(sp->size);
+	if (c >= 0 && (size_t)(STMINBLOCK << c) == sp->size &&
+	    stfreebytes + sp->size <= STFREEMAX) {
+		sp->prev = stfree[c];
+		stfree[c] = sp;
+		stfreebytes += sp->size;
+		ststat.retires++;
+	} else {
+		ckfree(sp);
+		ststat.frees++;
+	}
+}
+
 pointer
 stalloc(int nbytes)
 {
@@ -127,17 +226,13 @@ stalloc(int nbytes)
 
 	nbytes = SHELL_ALIGN(nbytes);
 	if (nbytes > stacknleft) {
-		int blocksize;
 		struct stack_block *sp;
 
-		blocksize = nbytes;
-		if (blocksize < MINSIZE)
-			blocksize = MINSIZE;
 		INTOFF;
-		sp = ckmalloc(sizeof(struct stack_block) - MINSIZE + blocksize);
+		sp = stnewblock(nbytes < MINSIZE ? MINSIZE : nbytes);
 		sp->prev = stackp;
 		stacknxt = sp->space;
-		stacknleft = blocksize;
+		stacknleft = sp->size;
 		stackp = sp;
 		INTON;
 	}
@@ -195,7 +290,7 @@ rststackmark(struct stackmark *mark)
 		/* delete any recently allocated mem blocks */
 		sp = stackp;
 		stackp = sp->prev;
-		ckfree(sp);
+		stretire(sp);
 	}
 	stacknxt = mark->stacknxt;
 	stacknleft = mark->stacknleft;
@@ -218,6 +313,7 @@ void
 growstackblock(void)
 {
 	int newlen = SHELL_ALIGN(stacknleft * 2 + 100);
+	int c;
 
 	INTOFF;
 	if (stacknxt == stackp->space && stackp != &stackbase) {
@@ -228,8 +324,21 @@ growstackblock(void)
 		oldstackp = stackp;
 		sp = stackp;
 		stackp = sp->prev;
-		sp = ckrealloc((pointer)sp,
-		    sizeof(struct stack_block) - MINSIZE + newlen);
+		c = stclass(newlen);
+		if (c >= 0 && stfree[c] != NULL) {
+			sp = stnewblock(newlen);
+			(void)memcpy(sp->space, oldstackp->space, stacknleft);
+			stretire(oldstackp);
+		} else {
+			if (c >= 0)
+				newlen = STMINBLOCK << c;
+			ststat.inuse += newlen - sp->size;
+			if (ststat.inuse > ststat.peak)
+				ststat.peak = ststat.inuse;
+			sp = ckrealloc((pointer)sp, STBLOCKHDR + newlen);
+			sp->size = newlen;
+		}
+		newlen = sp->size;
 		sp->prev = stackp;
 		stackp = sp;
 		stacknxt = sp->space;
@@ -338,3 +447,41 @@ ungrabstackstr(char *s, char *p)
 	stacknxt = s;
 	sstrnleft = stacknleft - (p - s);
 }
+
+#ifndef SMALL
+/*
+ * The stackstat builtin: report how the stack blocks have been used,
+ * with -r to zero the counters afterwards.
+ */
+
+int
+stackstatcmd(int argc, char **argv)
+{
+	int reset = 0;
+	int c, n;
+	struct stack_block *sp;
+
+	while ((c = nextopt("r")) != '\0')
+		reset = 1;
+
+	out1fmt("mallocs %lu\nreuses %lu\nretires %lu\nfrees %lu\n",
+	    ststat.mallocs, ststat.reuses, ststat.retires, ststat.frees);
+	out1fmt("inuse %lu\npeak %lu\npooled %lu\n",
+	    (unsigned long)ststat.inuse, (unsigned long)ststat.peak,
+	    (unsigned long)stfreebytes);
+	for (c = 0; c < STNCLASS; c++) {
+		n = 0;
+		for (sp = stfree[c]; sp != NULL; sp = sp->prev)
+			n++;
+		if (n != 0)
+			out1fmt("class %d %d\n", STMINBLOCK << c, n);
+	}
+
+	if (reset) {
+		ststat.mallocs = ststat.reuses = 0;
+		ststat.retires = ststat.frees = 0;
+		ststat.peak = ststat.inuse;
+	}
+	return 0;
+}
+#endif /* SMALL */
@@ -64,17 +64,64 @@ __RCSID("$NetBSD: miscbltin.c,v 1.44 2017/05/13 15:03:34 gson Exp $");
 #include "error.h"
 #include "builtins.h"
 #include "mystring.h"
+#include "expand.h"
 
 #undef rflag
 
 
 
+/*
+ * Input for the read builtin.
+ *
+ * We must not consume anything past the newline that ends the line,
+ * as whatever reads stdin next expects to get the rest.  So when stdin
+ * is a regular file, we read a block at a time and afterwards lseek()
+ * back over what we did not use.  Otherwise (pipes, terminals, ...) we
+ * must read a byte at a time, unless the user asked (read -B) to have
+ * what we read ahead kept here for the next read builtin.  That is
+ * only safe if nothing else reads the same input meanwhile, which is
+ * why it is not the default.  Any later read (with -B or not) uses up
+ * the kept data first; it is forgotten when stdin is no longer the same
+ * file (dev/ino) as when it was read.
+ */
+
+#define	READBLOCK	1024	/* size of a read ahead block */
+
+struct readbuf {
+	char *buf;
+	int size;		/* how much to read(), 1 or READBLOCK */
+	int pos;		/* next char to return */
+	int len;		/* end of valid data in buf */
+	dev_t dev;		/* what fd 0 was when buf was filled */
+	ino_t ino;
+};
+
+STATIC struct readbuf readkeep;		/* for read -B */
+
+STATIC int readchar(struct readbuf *, char *);
+
+STATIC int
+readchar(struct readbuf *rb, char *cp)
+{
+	int n;
+
+	if (rb->pos < rb->len) {
+		*cp = rb->buf[rb->pos++];
+		return 1;
+	}
+	n = read(0, rb->buf, rb->size);
+	if (n <= 0)
+		return 0;
+	rb->len = n;
+	rb->pos = 1;
+	*cp = rb->buf[0];
+	return 1;
+}
+
 /*
  * The read builtin.
  * Backslahes escape the next char unless -r is specified.
  *
- * This uses unbuffered input, which may be avoidable in some cases.
- *
  * Note that if IFS=' :' then read x y should work so that:
  * 'a b'	x='a', y='b'
  * ' a b '	x='a', y='b'
@@ -84,28 +131,43 @@ __RCSID("$NetBSD: miscbltin.c,v 1.44 2017/05/13 15:03:34 gson Exp $");
  * ': :'	x='',  y=''
  * ':::'	x='',  y='::'
  * ':b c:'	x='',  y='b c:'
+ *
+ * The words are collected (NUL separated) and only assigned once the
+ * line has been read, so that any input read ahead has been given back
+ * before setvar() can error() (eg: on a read only variable).
  */
 
 int
 readcmd(int argc, char **argv)
 {
 	char **ap;
+	char **vars;
 	char c;
 	int rflag;
+	int Bflag;
 	char *prompt;
 	const char *ifs;
 	char *p;
+	char *q;
 	int startword;
 	int status;
 	int i;
 	int is_ifs;
 	int saveall = 0;
+	int lastword = 0;
+	struct stat sb;
+	struct readbuf rb;
+	struct readbuf *rbp;
+	char block[READBLOCK];
 
 	rflag = 0;
+	Bflag = 0;
 	prompt = NULL;
-	while ((i = nextopt("p:r")) != '\0') {
+	while ((i = nextopt("Bp:r")) != '\0') {
 		if (i == 'p')
 			prompt = optionarg;
+		else if (i == 'B')
+			Bflag = 1;
 		else
 			rflag = 1;
 	}
@@ -117,22 +179,43 @@ readcmd(int argc, char **argv)
 
 	if (*(ap = argptr) == NULL)
 		error("arg count");
+	vars = ap;
 
 	if ((ifs = bltinlookup("IFS", 1)) == NULL)
 		ifs = " \t\n";
+	ifs = ifstable(ifs);
+
+	rb.buf = block;
+	rb.size = 1;
+	rb.pos = rb.len = 0;
+	rbp = &rb;
+	if (fstat(0, &sb) == 0) {
+		if (readkeep.dev != sb.st_dev || readkeep.ino != sb.st_ino)
+			readkeep.pos = readkeep.len = 0;
+		if (S_ISREG(sb.st_mode))
+			rb.size = READBLOCK;
+		else if (Bflag || readkeep.pos < readkeep.len) {
+			rbp = &readkeep;
+			if (readkeep.buf == NULL)
+				readkeep.buf = ckmalloc(READBLOCK);
+			readkeep.size = Bflag ? READBLOCK : 1;
+			readkeep.dev = sb.st_dev;
+			readkeep.ino = sb.st_ino;
+		}
+	}
 
 	status = 0;
 	startword = 2;
 	STARTSTACKSTR(p);
 	for (;;) {
-		if (read(0, &c, 1) != 1) {
+		if (!readchar(rbp, &c)) {
 			status = 1;
 			break;
 		}
 		if (c == '\0')
 			continue;
 		if (c == '\\' && !rflag) {
-			if (read(0, &c, 1) != 1) {
+			if (!readchar(rbp, &c)) {
 				status = 1;
 				break;
 			}
@@ -142,8 +225,8 @@ readcmd(int argc, char **argv)
 		}
 		if (c == '\n')
 			break;
-		if (strchr(ifs, c))
-			is_ifs = strchr(" \t\n", c) ? 1 : 2;
+		if (IFS_CLASS(ifs, c) & IFS_SEP)
+			is_ifs = IFS_CLASS(ifs, c) & IFS_WHITE ? 1 : 2;
 		else
 			is_ifs = 0;
 
@@ -183,25 +266,33 @@ readcmd(int argc, char **argv)
 			continue;
 		}
 
-		STACKSTRNUL(p);
-		setvar(*ap, stackblock(), 0);
+		STPUTC('\0', p);
+		lastword = p - stackblock();
 		ap++;
-		STARTSTACKSTR(p);
 	}
 	STACKSTRNUL(p);
+	q = grabstackstr(p + 1);	/* so setvar() cannot disturb it */
+
+	/* Give back whatever we read beyond the end of the line */
+	if (rbp == &rb && rb.pos < rb.len)
+		(void)lseek(0, -(off_t)(rb.len - rb.pos), SEEK_CUR);
 
 	/* Remove trailing IFS chars */
-	for (; stackblock() <= --p; *p = 0) {
-		if (!strchr(ifs, *p))
+	for (; q + lastword <= --p; *p = 0) {
+		if (!(IFS_CLASS(ifs, *p) & IFS_SEP))
 			break;
-		if (strchr(" \t\n", *p))
+		if (IFS_CLASS(ifs, *p) & IFS_WHITE)
 			/* Always remove whitespace */
 			continue;
 		if (saveall > 1)
 			/* Don't remove non-whitespace unless it was naked */
 			break;
 	}
-	setvar(*ap, stackblock(), 0);
+
+	for (; vars <= ap; vars++) {
+		setvar(*vars, q, 0);
+		q += strlen(q) + 1;
+	}
 
 	/* Set any remaining args to "" */
 	while (*++ap != NULL)
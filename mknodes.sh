@@ -134,6 +134,13 @@ echo "	struct nodelist *next;"
 echo "	union node *n;"
 echo "};"
 echo
+# A checksum of the layout above, so that an image of trees (made by
+# nodeimage()) from a shell with different nodes can be told apart.
+# Not "#define", as mknodenames.sh takes each of those to be a node type.
+IFS=' '
+set -- $(cksum <$objdir/nodes.h.tmp)
+echo "# define NODELAYOUT ${1}U"
+echo
 echo
 echo 'struct funcdef;'
 echo 'struct funcdef *copyfunc(union node *);'
@@ -141,6 +148,8 @@ echo 'union node *getfuncnode(struct funcdef *);'
 echo 'void reffunc(struct funcdef *);'
 echo 'void unreffunc(struct funcdef *);'
 echo 'void freefunc(struct funcdef *);'
+echo 'pointer nodeimage(union node **, int, size_t, size_t *, size_t *);'
+echo 'int nodeload(pointer, size_t, const size_t *, int, union node **);'
 
 mv $objdir/nodes.h.tmp $objdir/nodes.h || exit 1
 
@@ -235,6 +244,38 @@ while IFS=; read -r line; do
 		echo "      };"
 		echo "      new->type = n->type;"
 		;;
+	'%RELOC' )
+		echo "      switch (p->type) {"
+		IFS=' '
+		for struct in $struct_list; do
+			eval defines=\"\$define_$struct\"
+			for define in $defines; do
+				echo "      case $define:"
+			done
+			eval field=\$numfld_$struct
+			while
+				[ $field != 0 ]
+			do
+				eval line=\"\$field_${struct}_$field\"
+				field=$(($field - 1))
+				IFS=' '
+				set -- $line
+				name=$1
+				f="p->$struct.$name"
+				case $2 in
+				nodeptr ) fn="relocnode(";;
+				nodelist ) fn="relocnodelist(";;
+				string ) fn="relocstr(";;
+				temp )	echo "	    memset(&$f, 0, sizeof($f));"
+					continue;;
+				* ) continue;;
+				esac
+				echo "	    $f = ${fn}$f, off, rs);"
+			done
+			echo "	    break;"
+		done
+		echo "      };"
+		;;
 	* ) echo "$line";;
 	esac
 done
@@ -49,6 +49,7 @@ __RCSID("$NetBSD: mystring.c,v 1.18 2018/07/13 22:43:44 kre Exp $");
  *	scopyn(from, to, n)	Like scopy, but checks for overflow.
  *	number(s)		Convert a string of digits to an integer.
  *	is_number(s)		Return true if s is a string of digits.
+ *	strhash(s, term, lenp)	Hash a string, for the shell's hash tables.
  */
 
 #include <inttypes.h>
@@ -138,3 +139,44 @@ is_number(const char *p)
 	} while (*++p != '\0');
 	return 1;
 }
+
+/*
+ * Hash a string, up to a NUL or the character term, using FNV-1a with
+ * the high bits folded down (tables are indexed by the low bits only).
+ * If lenp is not NULL, the number of characters hashed is returned there.
+ */
+
+unsigned int
+strhash(const char *s, int term, int *lenp)
+{
+	const char *p = s;
+	unsigned int hashval = 2166136261U;
+
+	while (*p != '\0' && *p != term) {
+		hashval ^= (unsigned char)*p++;
+		hashval *= 16777619U;
+	}
+	if (lenp != NULL)
+		*lenp = p - s;
+
+	return hashval ^ (hashval >> 16);
+}
+
+
+/*
+ * The hash used by the perfect hash tables of keywords and builtins,
+ * for which mktokens and mkbuiltins choose a multiplier m that gives
+ * no collisions.  Those scripts compute the same thing (with awk, so
+ * without xor), so keep them in step with any change here.
+ */
+
+unsigned int
+perfhash(const char *s, unsigned int m)
+{
+	unsigned int hashval = 0;
+
+	while (*s != '\0')
+		hashval = hashval * m + (unsigned char)*s++;
+
+	return hashval + (hashval >> 16);
+}
@@ -40,6 +40,8 @@ void scopyn(const char *, char *, int);
 int prefix(const char *, const char *);
 int number(const char *);
 int is_number(const char *);
+unsigned int strhash(const char *, int, int *);
+unsigned int perfhash(const char *, unsigned int);
 
 #define equal(s1, s2)	(strcmp(s1, s2) == 0)
 #define scopy(s1, s2)	((void)strcpy(s2, s1))
@@ -380,6 +380,7 @@ setparam(char **argv)
 	shellparam.malloc = 1;
 	shellparam.nparam = nparam;
 	shellparam.p = newparam;
+	shellparam.base = newparam;
 	shellparam.optnext = NULL;
 }
 
@@ -396,21 +397,22 @@ freeparam(volatile struct shparam *param)
 	if (param->malloc) {
 		for (ap = param->p ; *ap ; ap++)
 			ckfree(*ap);
-		ckfree(param->p);
+		ckfree(param->base);
 	}
 }
 
 
 
 /*
- * The shift builtin command.
+ * The shift builtin command.  The parameters are not moved, the start
+ * of the list just advances past the ones shifted out.
  */
 
 int
 shiftcmd(int argc, char **argv)
 {
 	int n;
-	char **ap1, **ap2;
+	char **ap1;
 
 	if (argc > 2)
 		error("Usage: shift [n]");
@@ -425,9 +427,7 @@ shiftcmd(int argc, char **argv)
 		if (shellparam.malloc)
 			ckfree(*ap1);
 	}
-	ap2 = shellparam.p;
-	while ((*ap2++ = *ap1++) != NULL)
-		continue;
+	shellparam.p = ap1;
 	shellparam.optnext = NULL;
 	INTON;
 	return 0;
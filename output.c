@@ -55,6 +55,8 @@ __RCSID("$NetBSD: output.c,v 1.40 2017/11/21 03:42:39 kre Exp $");
 #include <sys/types.h>		/* quad_t */
 #include <sys/param.h>		/* BSD4_4 */
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #include <stdio.h>	/* defines BUFSIZ */
 #include <string.h>
@@ -73,6 +75,7 @@ __RCSID("$NetBSD: output.c,v 1.40 2017/11/21 03:42:39 kre Exp $");
 
 
 #define OUTBUFSIZ BUFSIZ
+#define OUTBUFMAX 65536		/* largest a buffer grows (not on a tty) */
 #define BLOCK_OUT -2		/* output to a fixed block of memory */
 #define MEM_OUT -3		/* output to dynamically allocated memory */
 
@@ -94,6 +97,16 @@ struct output *outx = &errout;
 struct output *outxtop = NULL;
 #endif
 
+STATIC struct {
+	unsigned long writes;		/* write(2) and writev(2) calls */
+	unsigned long writevs;		/* of those, writev(2) calls */
+	unsigned long long bytes;	/* bytes written by them */
+	unsigned long largest;		/* most bytes in one call */
+} outstats;
+
+STATIC int outgrow(struct output *);
+STATIC int xwritev(int, struct iovec *, int);
+
 
 #ifdef mkinit
 
@@ -270,6 +283,10 @@ emptyoutbuf(struct output *dest)
 		dest->nleft = sizeof out_junk;
 		dest->flags |= OUTPUT_ERR;
 	} else if (dest->buf == NULL) {
+		/* a buffer grown for a file or pipe is too big for a tty */
+		if (dest->bufsize > OUTBUFSIZ && dest->fd >= 0 &&
+		    !outgrow(dest))
+			dest->bufsize = OUTBUFSIZ;
 		INTOFF;
 		dest->buf = ckmalloc(dest->bufsize);
 		dest->nextc = dest->buf;
@@ -287,16 +304,84 @@ emptyoutbuf(struct output *dest)
 		INTON;
 	} else {
 		flushout(dest);
+		if (dest->bufsize < OUTBUFMAX && outgrow(dest)) {
+			INTOFF;
+			dest->bufsize <<= 1;
+			ckfree(dest->buf);
+			dest->buf = ckmalloc(dest->bufsize);
+			dest->nextc = dest->buf;
+			dest->nleft = dest->bufsize;
+			INTON;
+			VTRACE(DBG_OUTPUT, ("emptyoutbuf grew to %d for fd %d\n",
+			    dest->bufsize, dest->fd));
+		}
 	}
 	dest->nleft--;
 }
 
+/*
+ * A buffer which has filled is worth making bigger if it is
+ * being written to a file, pipe or socket.  Output to a terminal
+ * (or other device) stays in small chunks, so it appears promptly.
+ */
+STATIC int
+outgrow(struct output *dest)
+{
+	struct stat sb;
+
+	if (dest->flags & OUTPUT_ERR || fstat(dest->fd, &sb) == -1)
+		return 0;
+	return S_ISREG(sb.st_mode) || S_ISFIFO(sb.st_mode) ||
+	    S_ISSOCK(sb.st_mode);
+}
+
 
+/*
+ * Flush all the standard buffers.  Those which are destined for
+ * the same file descriptor (trace output and stderr, typically)
+ * are written together, in order, by a single writev().
+ */
 void
 flushall(void)
 {
-	flushout(&output);
-	flushout(&errout);
+	struct output *list[3];
+	struct iovec iov[3];
+	int i, j, n, cnt;
+
+	n = 0;
+	list[n++] = &output;
+	list[n++] = &errout;
+#ifndef SMALL
+	if (outx != &output && outx != &errout)
+		list[n++] = outx;
+#endif
+
+	for (i = 0; i < n; i = j) {
+		cnt = 0;
+		for (j = i; j < n && list[j]->fd == list[i]->fd; j++) {
+			if (list[j]->buf == NULL || list[j]->nextc == list[j]->buf)
+				continue;
+			iov[cnt].iov_base = list[j]->buf;
+			iov[cnt].iov_len = list[j]->nextc - list[j]->buf;
+			cnt++;
+		}
+		if (cnt <= 1 || list[i]->fd < 0) {
+			while (i < j)
+				flushout(list[i++]);
+			continue;
+		}
+		VTRACE(DBG_OUTPUT, ("flushall fd=%d %d buffers\n",
+		    list[i]->fd, cnt));
+		cnt = xwritev(list[i]->fd, iov, cnt) < 0;
+		for (; i < j; i++) {
+			if (cnt && list[i]->nextc != list[i]->buf)
+				list[i]->flags |= OUTPUT_ERR;
+			if (list[i]->buf != NULL) {
+				list[i]->nextc = list[i]->buf;
+				list[i]->nleft = list[i]->bufsize;
+			}
+		}
+	}
 }
 
 
@@ -611,7 +696,11 @@ xwrite(int fd, char *buf, int nbytes)
 	ntry = 0;
 	while (n > 0) {
 		i = write(fd, buf, n);
+		outstats.writes++;
 		if (i > 0) {
+			outstats.bytes += i;
+			if ((unsigned long)i > outstats.largest)
+				outstats.largest = i;
 			if ((n -= i) <= 0)
 				return nbytes;
 			buf += i;
@@ -626,7 +715,78 @@ xwrite(int fd, char *buf, int nbytes)
 	return nbytes;
 }
 
+/*
+ * Like xwrite() but for several buffers at once; returns the
+ * number of bytes written, or -1.  The iovec array is altered.
+ */
+STATIC int
+xwritev(int fd, struct iovec *iov, int cnt)
+{
+	ssize_t i;
+	int ntry;
+	int total;
+
+	total = 0;
+	ntry = 0;
+	while (cnt > 0) {
+		i = writev(fd, iov, cnt);
+		outstats.writes++;
+		outstats.writevs++;
+		if (i > 0) {
+			outstats.bytes += i;
+			if ((unsigned long)i > outstats.largest)
+				outstats.largest = i;
+			total += i;
+			ntry = 0;
+			while (cnt > 0 && (size_t)i >= iov->iov_len) {
+				i -= iov->iov_len;
+				iov++;
+				cnt--;
+			}
+			if (cnt > 0) {
+				iov->iov_base = (char *)iov->iov_base + i;
+				iov->iov_len -= i;
+			}
+		} else if (i == 0) {
+			if (++ntry > 10)
+				return total;
+		} else if (errno != EINTR) {
+			return -1;
+		}
+	}
+	return total;
+}
+
 #ifndef SMALL
+/*
+ * The outstat builtin: report the writes the shell's output
+ * routines have made, with -r to zero the counters afterwards.
+ */
+
+int
+outstatcmd(int argc, char **argv)
+{
+	unsigned long writes = outstats.writes;
+	unsigned long long bytes = outstats.bytes;
+	int reset = 0;
+
+	while (nextopt("r") != '\0')
+		reset = 1;
+
+	out1fmt("writes %lu\nwritevs %lu\nbytes %llu\n",
+	    writes, outstats.writevs, bytes);
+	out1fmt("average %llu\nlargest %lu\n",
+	    writes ? bytes / writes : 0, outstats.largest);
+
+	if (reset) {
+		flushout(out1);
+		outstats.writes = outstats.writevs = 0;
+		outstats.bytes = 0;
+		outstats.largest = 0;
+	}
+	return 0;
+}
+
 static void
 xtrace_fd_swap(int from, int to)
 {
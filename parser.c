@@ -1015,19 +1015,14 @@ readtoken(void)
 	 * check for keywords and aliases
 	 */
 	if (t == TWORD && !quoteflag) {
-		const char *const *pp;
-
-		if (checkkwd & CHKKWD)
-			for (pp = parsekwd; *pp; pp++) {
-				if (**pp == *wordtext && equal(*pp, wordtext)) {
-					lasttoken = t = pp -
-					    parsekwd + KWDOFFSET;
-					VTRACE(DBG_PARSE,
-					    ("keyword %s recognized @%d\n",
-					    tokname[t], plinno));
-					goto out;
-				}
-			}
+		int kwd;
+
+		if (checkkwd & CHKKWD && (kwd = findkwd(wordtext)) != 0) {
+			lasttoken = t = kwd;
+			VTRACE(DBG_PARSE, ("keyword %s recognized @%d\n",
+			    tokname[t], plinno));
+			goto out;
+		}
 
 		if (checkkwd & CHKALIAS &&
 		    (ap = lookupalias(wordtext, 1)) != NULL) {
@@ -2460,6 +2455,22 @@ noexpand(char *text)
 }
 
 
+/*
+ * Return the token for the reserved word s, or 0 if it is not one.
+ */
+
+int
+findkwd(const char *s)
+{
+	int t;
+
+	t = kwdhash[perfhash(s, KWDHASHMULT) & (KWDHASHSIZE - 1)];
+	if (t != 0 && equal(parsekwd[t - KWDOFFSET], s))
+		return t;
+	return 0;
+}
+
+
 /*
  * Return true if the argument is a legal variable name (a letter or
  * underscore followed by zero or more letters, underscores, and digits).
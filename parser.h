@@ -73,6 +73,7 @@
 
 union node *parsecmd(int);
 void fixredir(union node *, const char *, int);
+int findkwd(const char *);
 int goodname(const char *);
 int isassignment(const char *);
 const char *getprompt(void *);
@@ -43,7 +43,9 @@ __RCSID("$NetBSD: redir.c,v 1.66 2019/03/01 06:15:01 kre Exp $");
 
 #include <sys/types.h>
 #include <sys/param.h>	/* PIPE_BUF */
+#include <sys/mman.h>	/* memfd_create() */
 #include <sys/stat.h>
+#include <paths.h>
 #include <signal.h>
 #include <string.h>
 #include <fcntl.h>
@@ -60,6 +62,7 @@ __RCSID("$NetBSD: redir.c,v 1.66 2019/03/01 06:15:01 kre Exp $");
 #include "shell.h"
 #include "nodes.h"
 #include "jobs.h"
+#include "exec.h"
 #include "options.h"
 #include "expand.h"
 #include "redir.h"
@@ -123,7 +126,8 @@ STATIC const struct renamelist *is_renamed(const struct renamelist *, int);
 STATIC void fd_rename(struct redirtab *, int, int);
 STATIC void free_rl(struct redirtab *, int);
 STATIC void openredirect(union node *, char[10], int);
-STATIC int openhere(const union node *);
+STATIC int openhere(const union node *, int);
+STATIC int heretmpfile(void);
 STATIC int copyfd(int, int, int);
 STATIC void find_big_fd(void);
 
@@ -268,6 +272,11 @@ redirect(union node *redir, int flags)
 		if (fd == 0)
 			fd0_redirected++;
 		openredirect(n, memory, flags);
+		EVTRACE(EVT_REDIR, fd,
+		    n->type == NTOFD || n->type == NFROMFD ? n->ndup.dupfd : -1,
+		    n->type == NHERE || n->type == NXHERE ||
+		    n->type == NTOFD || n->type == NFROMFD ?
+		    NULL : n->nfile.expfname);
 	}
 	if (memory[1])
 		out1 = &memout;
@@ -284,6 +293,7 @@ openredirect(union node *redir, char memory[10], int flags)
 	char *fname;
 	int f;
 	int eflags, cloexec;
+	int creat = 0;
 
 	/*
 	 * We suppress interrupts so that we won't leave open file
@@ -311,6 +321,7 @@ openredirect(union node *redir, char memory[10], int flags)
 		fname = redir->nfile.expfname;
 		if ((f = open(fname, O_RDWR|O_CREAT, 0666)) < 0)
 			goto ecreate;
+		creat = 1;
 		VTRACE(DBG_REDIR, ("openredirect(<> '%s') -> %d", fname, f));
 		break;
 	case NTO:
@@ -320,6 +331,7 @@ openredirect(union node *redir, char memory[10], int flags)
 				if ((f = open(fname, O_WRONLY|O_CREAT|O_EXCL,
 				    0666)) < 0)
 					goto ecreate;
+				creat = 1;
 			} else if (fstat(f, &sb) == -1) {
 				int serrno = errno;
 				close(f);
@@ -339,12 +351,14 @@ openredirect(union node *redir, char memory[10], int flags)
 		fname = redir->nfile.expfname;
 		if ((f = open(fname, O_WRONLY|O_CREAT|O_TRUNC, 0666)) < 0)
 			goto ecreate;
+		creat = 1;
 		VTRACE(DBG_REDIR, ("openredirect(> '%s') -> %d", fname, f));
 		break;
 	case NAPPEND:
 		fname = redir->nfile.expfname;
 		if ((f = open(fname, O_WRONLY|O_CREAT|O_APPEND, 0666)) < 0)
 			goto ecreate;
+		creat = 1;
 		VTRACE(DBG_REDIR, ("openredirect(>> '%s') -> %d", fname, f));
 		break;
 	case NTOFD:
@@ -369,12 +383,20 @@ openredirect(union node *redir, char memory[10], int flags)
 	case NHERE:
 	case NXHERE:
 		VTRACE(DBG_REDIR, ("openredirect: %d<<...", fd));
-		f = openhere(redir);
+		f = openhere(redir, flags);
 		break;
 	default:
 		abort();
 	}
 
+	/*
+	 * If we (perhaps) made a new file, it might be in a PATH directory.
+	 * Devices (>/dev/null) are never new, so do not count those.
+	 */
+	if (creat && !fschanged &&
+	    (fstat(f, &sb) == -1 || S_ISREG(sb.st_mode)))
+		fschanged = 1;
+
 	cloexec = fd > 2 && (flags & REDIR_KEEP) == 0 && !posix;
 	if (f != fd) {
 		VTRACE(DBG_REDIR, (" -> %d", fd));
@@ -402,25 +424,47 @@ openredirect(union node *redir, char memory[10], int flags)
 
 
 /*
- * Handle here documents.  Normally we fork off a process to write the
- * data to a pipe.  If the document is short, we can stuff the data in
- * the pipe without forking.
+ * Handle here documents.  If the document is short, we can stuff the
+ * data in a pipe.  A longer one is written to an unnamed temporary file
+ * (which the command can also seek on).  A document which needs to be
+ * expanded is expanded here, when that has no side effects (and we have
+ * not been vfork()ed).  Otherwise we fork off a process to expand it,
+ * and write the data to a pipe, as we also do if there is no temporary
+ * file to be had.
  */
 
 STATIC int
-openhere(const union node *redir)
+openhere(const union node *redir, int flags)
 {
+	struct stackmark smark;
+	char *text = NULL;
 	int pip[2];
 	int len = 0;
+	int fd;
 
-	if (pipe(pip) < 0)
-		error("Pipe call failed");
+	setstackmark(&smark);
 	if (redir->type == NHERE) {
-		len = strlen(redir->nhere.doc->narg.text);
-		if (len <= PIPESIZE) {
-			xwrite(pip[1], redir->nhere.doc->narg.text, len);
-			goto out;
+		text = redir->nhere.doc->narg.text;
+		len = strlen(text);
+	} else if ((flags & REDIR_VFORK) == 0 &&
+	    (len = expandheredoc(redir->nhere.doc)) >= 0)
+		text = stackblock();
+
+	if (text != NULL && len > PIPESIZE && (fd = heretmpfile()) >= 0) {
+		if (xwrite(fd, text, len) == len &&
+		    lseek(fd, 0, SEEK_SET) == 0) {
+			popstackmark(&smark);
+			VTRACE(DBG_REDIR, (" (tmpfile fd=%d)", fd));
+			return fd;
 		}
+		close(fd);
+	}
+
+	if (pipe(pip) < 0)
+		error("Pipe call failed");
+	if (text != NULL && len <= PIPESIZE) {
+		xwrite(pip[1], text, len);
+		goto out;
 	}
 	VTRACE(DBG_REDIR, (" forking [%d,%d]\n", pip[0], pip[1]));
 	if (forkshell(NULL, NULL, FORK_NOJOB) == 0) {
@@ -432,8 +476,8 @@ openhere(const union node *redir)
 		signal(SIGTSTP, SIG_IGN);
 #endif
 		signal(SIGPIPE, SIG_DFL);
-		if (redir->type == NHERE)
-			xwrite(pip[1], redir->nhere.doc->narg.text, len);
+		if (text != NULL)
+			xwrite(pip[1], text, len);
 		else
 			expandhere(redir->nhere.doc, pip[1]);
 		VTRACE(DBG_PROCS|DBG_REDIR, ("wrote here doc.  exiting\n"));
@@ -442,10 +486,37 @@ openhere(const union node *redir)
 	VTRACE(DBG_REDIR, ("openhere (closing %d)", pip[1]));
  out:
 	close(pip[1]);
+	popstackmark(&smark);
 	VTRACE(DBG_REDIR, (" (pipe fd=%d)", pip[0]));
 	return pip[0];
 }
 
+/*
+ * Make an unnamed temporary file, for a here document, or return -1.
+ * Like the pipe it replaces, it is not close-on-exec: it may already
+ * have the number of the fd it is for, and then is not copied at all.
+ */
+
+STATIC int
+heretmpfile(void)
+{
+	char name[] = _PATH_TMP "sh-hereXXXXXX";
+	int fd;
+
+#ifdef MFD_CLOEXEC
+	if ((fd = memfd_create("sh-here", 0)) >= 0)
+		return fd;
+#endif
+#ifdef O_TMPFILE
+	if ((fd = open(_PATH_TMP, O_TMPFILE | O_RDWR, 0600)) >= 0)
+		return fd;
+#endif
+	if ((fd = mkstemp(name)) < 0)
+		return -1;
+	unlink(name);
+	return fd;
+}
+
 
 
 /*
@@ -54,6 +54,10 @@ __RCSID("$NetBSD: show.c,v 1.53 2019/02/14 13:27:59 kre Exp $");
 
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <sys/mman.h>
+#include <paths.h>
+#include <string.h>
+#include <time.h>
 
 #include "shell.h"
 #include "parser.h"
@@ -68,6 +72,8 @@ __RCSID("$NetBSD: show.c,v 1.53 2019/02/14 13:27:59 kre Exp $");
 #include "output.h"
 #include "var.h"
 #include "builtins.h"
+#include "eval.h"
+#include "memalloc.h"
 
 #define DEFINE_NODENAMES
 #include "nodenames.h"		/* does almost nothing if !defined(DEBUG) */
@@ -92,7 +98,11 @@ typedef struct traceinfo {
 #define	SUP_SP	0x03	/* suppress spaces */
 #define	SUP_WSP	0x04	/* suppress all white space */
 
-#ifdef DEBUG		/* from here to end of file ... */
+#ifndef SMALL
+static void evtrace_set(int);
+#endif
+
+#ifdef DEBUG		/* from here to near the end of the file ... */
 
 TFILE tracedata, *tracetfile;
 FILE *tracefile;		/* just for histedit */
@@ -1118,6 +1128,10 @@ set_debug(const char * flags, int on)
 			if (*flags == '+')
 				flags++, verbose=1;
 		}
+		if (f == 'b') {
+			evtrace_set(on);
+			continue;
+		}
 
 		/*
 		 * Note: turning on any debug option also enables DBG_ALWAYS
@@ -1142,11 +1156,176 @@ set_debug(const char * flags, int on)
 	}
 }
 
+#endif /* DEBUG */
+
+#ifndef SMALL
+/*
+ * Binary event tracing, turned on by "debug -b" in any shell that is
+ * not SMALL (the text tracing above needs DEBUG).  Events are the
+ * fixed size records of evtrace.h, stored in a ring in a file that
+ * the shell maps, so recording one costs a clock read and a copy, and
+ * nothing is written until the kernel gets to it.  The subshells it
+ * forks inherit the mapping, and record into the same ring.  evdump
+ * decodes the file afterwards.
+ */
+
+int evtracing;			/* evring is mapped */
+static struct evt_ring *evring;
+static pid_t evpid;		/* this process */
+static char *evname;		/* the file, if this process made it */
+
+static uint64_t
+evclock(clockid_t clk)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(clk, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Create and map a ring in $EVENTDIR (or _PATH_TMP), returning 0 or
+ * an errno.
+ */
+static int
+evtrace_open(void)
+{
+	const char *dir;
+	struct evt_ring *r;
+	char *name;
+	size_t len;
+	int fd, e;
+
+	dir = lookupvar("EVENTDIR");
+	if (dir == NULL || *dir == '\0')
+		dir = _PATH_TMP;
+	evpid = getpid();
+	len = strlen(dir) + sizeof("/sh-events..XXXXXX") + 3 * sizeof(int);
+	name = ckmalloc(len);
+	fmtstr(name, len, "%s%ssh-events.%d.XXXXXX", dir,
+	    dir[strlen(dir) - 1] == '/' ? "" : "/", (int)evpid);
+	if ((fd = mkstemp(name)) < 0) {
+		e = errno;
+		ckfree(name);
+		return e;
+	}
+	if (ftruncate(fd, sizeof *r) == -1)
+		r = MAP_FAILED;
+	else
+		r = mmap(NULL, sizeof *r, PROT_READ|PROT_WRITE, MAP_SHARED,
+		    fd, 0);
+	e = errno;
+	close(fd);
+	if (r == MAP_FAILED) {
+		(void)unlink(name);
+		ckfree(name);
+		return e;
+	}
+
+	memcpy(r->er_hdr.eh_magic, EVT_MAGIC, sizeof r->er_hdr.eh_magic);
+	r->er_hdr.eh_version = EVT_VERSION;
+	r->er_hdr.eh_recsize = sizeof (struct evt_rec);
+	r->er_hdr.eh_nrec = EVT_NREC;
+	r->er_hdr.eh_pid = evpid;
+	r->er_hdr.eh_ppid = getppid();
+	r->er_hdr.eh_base = evclock(CLOCK_MONOTONIC);
+	r->er_hdr.eh_start = evclock(CLOCK_REALTIME);
+	evring = r;
+	evname = name;
+	evtracing = 1;
+	return 0;
+}
+
+/*
+ * Stop recording, removing the file if this process made it, and no
+ * event was ever recorded in it.
+ */
+void
+evtrace_close(void)
+{
+	if (evring != NULL) {
+		if (evname != NULL && evring->er_hdr.eh_next == 0)
+			(void)unlink(evname);
+		(void)munmap(evring, sizeof *evring);
+	}
+	if (evname != NULL)
+		ckfree(evname);
+	evname = NULL;
+	evring = NULL;
+	evtracing = 0;
+}
+
+static void
+evtrace_set(int on)
+{
+	int e = 0;
+
+	INTOFF;
+	if (!on)
+		evtrace_close();
+	else if (!evtracing)
+		e = evtrace_open();
+	INTON;
+	if (e != 0)
+		error("Cannot create event trace: %s", strerror(e));
+}
+
+/*
+ * After a fork the child goes on recording into its parent's ring,
+ * but the file is not its own to remove.  A vfork child changes
+ * nothing, and records its own pid in each event.
+ */
+void
+evtrace_fork(void)
+{
+	if (!evtracing)
+		return;
+	evpid = getpid();
+	if (evname != NULL) {
+		ckfree(evname);
+		evname = NULL;
+	}
+}
+
+void
+evtrace(int type, int a, int b, const char *text)
+{
+	struct evt_rec *er;
+	size_t i;
+
+	/* other processes can be recording too, so take the slot at once */
+	i = __sync_fetch_and_add(&evring->er_hdr.eh_next, 1);
+	er = &evring->er_rec[i & (EVT_NREC - 1)];
+	er->er_time = evclock(CLOCK_MONOTONIC);
+	er->er_pid = vforked ? getpid() : evpid;
+	er->er_type = type;
+	er->er_a = a;
+	er->er_b = b;
+	er->er_line = line_number;
+	i = 0;
+	if (text != NULL)
+		for (; i < sizeof er->er_text - 1 && text[i] != '\0'; i++)
+			er->er_text[i] = text[i];
+	er->er_text[i] = '\0';
+}
+
+#ifndef DEBUG
+/*
+ * Without DEBUG, 'b' is the only flag there is.
+ */
+void
+set_debug(const char *flags, int on)
+{
+	if (strchr(flags, 'b') != NULL)
+		evtrace_set(on);
+}
+#endif
 
 int
 debugcmd(int argc, char **argv)
 {
 	if (argc == 1) {
+#ifdef DEBUG
 		struct debug_flag *df;
 
 		out1fmt("Debug: %sabled.  Flags: ", debug ? "en" : "dis");
@@ -1159,6 +1338,11 @@ debugcmd(int argc, char **argv)
 			else if (df->flag & DFlags)
 				out1c(df->label);
 		}
+#else
+		out1str("Flags: ");
+#endif
+		if (evtracing)
+			out1c('b');
 		out1c('\n');
 		return 0;
 	}
@@ -1173,5 +1357,4 @@ debugcmd(int argc, char **argv)
 	}
 	return 0;
 }
-
-#endif /* DEBUG */
+#endif /* !SMALL */
@@ -44,3 +44,19 @@ void trputc(int);
 void trputs(const char *);
 void opentrace(void);
 #endif
+
+#ifndef SMALL
+#include "evtrace.h"
+
+extern int evtracing;		/* "debug -b": recording events */
+void evtrace(int, int, int, const char *);
+void evtrace_fork(void);
+void evtrace_close(void);
+void set_debug(const char *, int);
+#define	EVTRACE(type, a, b, text)	do {				\
+				    if (evtracing)			\
+					evtrace((type), (a), (b), (text)); \
+				} while (/*CONSTCOND*/ 0)
+#else
+#define	EVTRACE(type, a, b, text)	/* binary event trace (evtrace.h) */
+#endif
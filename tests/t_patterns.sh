@@ -0,0 +1,43 @@
+#	$NetBSD$
+#
+# Pattern matching, in case and in pathname expansion.
+#
+#	sh t_patterns.sh [shell]
+#
+# runs the tests with the shell named (default ./ash), and exits 0 only
+# if they all pass.
+
+SH=${1:-./ash}
+fail=0
+
+# check name expected script: runs script, which must print expected
+check()
+{
+	got=$("${SH}" -c "$3" 2>&1)
+	if [ "${got}" != "$2" ]; then
+		printf '%s: FAIL\n  expected: %s\n  got:      %s\n' "$1" "$2" \
+		    "${got}"
+		fail=1
+	else
+		printf '%s: ok\n' "$1"
+	fi
+}
+
+# A backslash at the end of a pattern has nothing to escape, so it is a
+# literal backslash.  Dropping it made "a\" match "a", and "*\" anything.
+check trailing_bs_lit 'no' \
+    'p="a\\"; case a in $p) echo yes;; *) echo no;; esac'
+check trailing_bs_star 'no' \
+    'p="*\\"; case x in $p) echo yes;; *) echo no;; esac'
+check trailing_bs_self 'yes' \
+    'p="a\\"; case "a\\" in $p) echo yes;; *) echo no;; esac'
+check trailing_bs_star_self 'yes' \
+    'p="*\\"; case "x\\" in $p) echo yes;; *) echo no;; esac'
+check escaped_paren 'yes' \
+    'case a in a\)) echo no;; esac; case "a)" in a\)) echo yes;; esac'
+check trailing_bs_glob 'a\ b' \
+    'cd "${TMPDIR:-/tmp}" && d=$(mktemp -d sh-pat.XXXXXX) && cd "$d" &&
+     touch a "a\\" b && p="*\\"; set -- $p; q="b*"; echo "$@" $q;
+     cd .. && rm -rf "$d"'
+
+exit ${fail}
@@ -0,0 +1,45 @@
+#	$NetBSD$
+#
+# The profile builtin.
+#
+#	sh t_profile.sh [shell]
+#
+# runs the tests with the shell named (default ./ash), and exits 0 only
+# if they all pass.
+
+SH=${1:-./ash}
+fail=0
+
+# check name expected script: runs script, which must print expected
+check()
+{
+	got=$("${SH}" -c "$3" 2>&1)
+	if [ "${got}" != "$2" ]; then
+		printf '%s: FAIL\n  expected: %s\n  got:      %s\n' "$1" "$2" \
+		    "${got}"
+		fail=1
+	else
+		printf '%s: ok\n' "$1"
+	fi
+}
+
+if ! "${SH}" -c 'command -v profile' >/dev/null 2>&1; then
+	echo "no profile builtin (a SMALL shell): skipped"
+	exit 0
+fi
+
+CAT=$(command -v cat)
+
+# Each member of a pipeline that runs an external command is counted,
+# as a command and as an exec, just as it is outside a pipeline.
+check pipe_members "${CAT} 3 3" \
+    "profile -b; echo x | ${CAT} | ${CAT} | ${CAT} >/dev/null; profile -e
+     profile | awk '\$1 == \"${CAT}\" { print \$1, \$2, \$7 }'"
+check pipe_line_execs "3" \
+    "profile -b; echo x | ${CAT} | ${CAT} | ${CAT} >/dev/null; profile -e
+     profile | awk '\$1 == \"line\" { n++ } n == 1 && \$1 == 1 { print \$7 }'"
+check plain_command "${CAT} 2 2" \
+    "profile -b; ${CAT} </dev/null; ${CAT} </dev/null; profile -e
+     profile | awk '\$1 == \"${CAT}\" { print \$1, \$2, \$7 }'"
+
+exit ${fail}
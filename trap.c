@@ -810,6 +810,7 @@ dotrap(void)
 		    tr ? "\"" : "", tr ? tr : "NULL", tr ? "\"" : ""));
 
 		if (tr != NULL) {
+			EVTRACE(EVT_TRAP, i, 0, NULL);
 			last_trapsig = i;
 			save_skipstate(&saveskip);
 			savestatus = exitstatus;
@@ -919,6 +920,10 @@ exitshell_savedstatus(void)
 		flushall();
 #if JOBS
 		setjobctl(0);
+#endif
+#ifndef SMALL
+		if (evtracing)
+			evtrace_close();
 #endif
 	}
 
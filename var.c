@@ -73,14 +73,19 @@ __RCSID("$NetBSD: var.c,v 1.78 2019/02/14 11:15:24 kre Exp $");
 #include "parser.h"
 #include "show.h"
 #include "machdep.h"
+#include "arithmetic.h"
 #ifndef SMALL
 #include "myhistedit.h"
 #endif
 
+/*
+ * Initial size of the variable hash table, which is doubled whenever
+ * it holds more variables than it has buckets.  Must be a power of 2.
+ */
 #ifdef SMALL
-#define VTABSIZE 39
+#define VTABSIZE 32
 #else
-#define VTABSIZE 517
+#define VTABSIZE 256
 #endif
 
 
@@ -103,6 +108,7 @@ char *get_random(struct var *);
 #endif
 
 struct localvar *localvars;
+int forcelocal;			/* make all assignments local (see evalbackcmd) */
 
 #ifndef SMALL
 struct var vhistsize;
@@ -185,13 +191,46 @@ const struct varinit varinit[] = {
 	   { NULL } }
 };
 
-struct var *vartab[VTABSIZE];
+STATIC struct var *vartab_init[VTABSIZE];
+STATIC struct var **vartab = vartab_init;	/* the hash table */
+STATIC unsigned int vartabsize = VTABSIZE;	/* buckets in vartab */
+STATIC unsigned int nvars;			/* variables in vartab */
+unsigned int vargen;			/* changed when a var is deleted */
+
+/*
+ * All variables, in the order they were created, so that the order
+ * in which they are listed does not depend upon the hash table.
+ */
+STATIC struct var *varlist;
+STATIC struct var **varlast = &varlist;
+
+/*
+ * The environment for exec'd commands is kept, and only rebuilt after
+ * something changes the value or flags of an exported variable (which
+ * sets envdirty).  VFUNCREF variables are evaluated afresh every time,
+ * envrefs says where they go.
+ */
+STATIC char **envvec;			/* cached environment() */
+STATIC int envvecsize;			/* slots allocated in envvec */
+STATIC int nenvvec;			/* vars in envvec */
+STATIC struct envref {
+	struct var *vp;
+	int slot;			/* index in envvec */
+} *envrefs;
+STATIC int nenvrefs;
+STATIC int envdirty = 1;		/* envvec needs to be rebuilt */
 
 STATIC int strequal(const char *, const char *);
-STATIC struct var *find_var(const char *, struct var ***, int *);
+STATIC void intvartext(struct var *);
+STATIC struct var *find_var(const char *, int *);
+STATIC void add_var(struct var *);
+STATIC void delete_var(struct var *);
+STATIC void grow_vartab(void);
 STATIC void showvar(struct var *, const char *, const char *, int);
 static void export_usage(const char *) __dead;
 STATIC int makespecial(const char *);
+STATIC void localise(const char *, int);
+STATIC void mkenviron(void);
 
 /*
  * Initialize the varable symbol tables and import the environment
@@ -297,26 +336,23 @@ initvar(void)
 {
 	const struct varinit *ip;
 	struct var *vp;
-	struct var **vpp;
 
 	for (ip = varinit ; (vp = ip->var) != NULL ; ip++) {
-		if (find_var(ip->text, &vpp, &vp->name_len) != NULL)
+		if (find_var(ip->text, &vp->name_len) != NULL)
 			continue;
-		vp->next = *vpp;
-		*vpp = vp;
 		vp->text = strdup(ip->text);
 		vp->flags = (ip->flags & ~VTEXTFIXED) | VSTRFIXED;
 		vp->v_u = ip->v_u;
+		add_var(vp);
 	}
 	/*
 	 * PS1 depends on uid
 	 */
-	if (find_var("PS1", &vpp, &vps1.name_len) == NULL) {
-		vps1.next = *vpp;
-		*vpp = &vps1;
+	if (find_var("PS1", &vps1.name_len) == NULL) {
 		vps1.flags = VSTRFIXED;
 		vps1.text = NULL;
 		choose_ps1();
+		add_var(&vps1);
 	}
 }
 
@@ -448,13 +484,15 @@ setvar(const char *name, const char *val, int flags)
 void
 setvareq(char *s, int flags)
 {
-	struct var *vp, **vpp;
+	struct var *vp;
 	int nlen;
 
 	VTRACE(DBG_VARS, ("setvareq([%s],%#x) aflag=%d ", s, flags, aflag));
 	if (aflag && !(flags & VNOEXPORT))
 		flags |= VEXPORT;
-	vp = find_var(s, &vpp, &nlen);
+	if (forcelocal && !(flags & VNOSET))
+		localise(s, strchr(s, '=') - s);
+	vp = find_var(s, &nlen);
 	if (vp != NULL) {
 		VTRACE(DBG_VARS, ("was [%s] fl:%#x\n", vp->text,
 		    vp->flags));
@@ -473,6 +511,9 @@ setvareq(char *s, int flags)
 
 		INTOFF;
 
+		if ((vp->flags | flags) & VEXPORT)
+			envdirty = 1;
+
 		if (vp->func && !(vp->flags & VFUNCREF) && !(flags & VNOFUNC))
 			(*vp->func)(s + vp->name_len + 1);
 
@@ -486,7 +527,7 @@ setvareq(char *s, int flags)
 		if (vp->rfunc && (vp->flags & (VFUNCREF|VSPECIAL)) == VFUNCREF)
 			vp->rfunc = NULL;
 
-		vp->flags &= ~(VTEXTFIXED|VSTACK|VUNSET);
+		vp->flags &= ~(VTEXTFIXED|VSTACK|VUNSET|VINT|VINTONLY);
 		if (flags & VNOEXPORT)
 			vp->flags &= ~VEXPORT;
 		if (flags & VDOEXPORT)
@@ -518,8 +559,7 @@ setvareq(char *s, int flags)
 	vp->text = s;
 	vp->name_len = nlen;
 	vp->func = NULL;
-	vp->next = *vpp;
-	*vpp = vp;
+	add_var(vp);
 
 	VTRACE(DBG_VARS, ("new [%s] (%d) %#x\n", s, nlen, vp->flags));
 }
@@ -559,12 +599,23 @@ listmklocal(struct strlist *list, int flags)
 char *
 lookupvar(const char *name)
 {
-	struct var *v;
+
+	return lookupvp(find_var(name, NULL));
+}
+
+/*
+ * The same, for a var found earlier with findvar().
+ */
+
+char *
+lookupvp(struct var *v)
+{
 	char *p;
 
-	v = find_var(name, NULL, NULL);
 	if (v == NULL || v->flags & VUNSET)
 		return NULL;
+	if (v->flags & VINTONLY)
+		intvartext(v);
 	if (v->rfunc && (v->flags & VFUNCREF) != 0) {
 		p = (*v->rfunc)(v);
 		if (p == NULL)
@@ -577,6 +628,90 @@ lookupvar(const char *name)
 
 
 
+/*
+ * Arithmetic keeps the numeric value of a variable it has used in
+ * vp->ival (flag VINT), so it need not convert the text each time.
+ * An arithmetic assignment to a plain variable (one which is not
+ * exported, readonly, special or local) sets only ival, and marks
+ * the text as out of date (VINTONLY); intvartext() makes the text
+ * again when anything else wants it.  Anything which gives a
+ * variable a new text value clears both flags.
+ */
+
+/*
+ * If the integer value of vp is known, put it in *valp and return 1.
+ */
+
+int
+lookupvarint(struct var *vp, intmax_t *valp)
+{
+
+	if (vp == NULL || (vp->flags & (VINT|VUNSET|VFUNCREF)) != VINT)
+		return 0;
+	*valp = vp->ival;
+	return 1;
+}
+
+/*
+ * Remember val as the integer value of vp's (unchanged) text.
+ */
+
+void
+savevarint(struct var *vp, intmax_t val)
+{
+
+	if (vp == NULL || vp->flags & (VUNSET|VFUNCREF))
+		return;
+	vp->ival = val;
+	vp->flags |= VINT;
+}
+
+/*
+ * Assign the number val to the variable name (whose struct var is vp,
+ * if that is known).
+ */
+
+void
+setvarint(const char *name, struct var *vp, intmax_t val)
+{
+	char buf[DIGITS(val) + 1];
+
+	if (vp != NULL && !aflag && !forcelocal && vp->func == NULL &&
+	    (vp->flags & (VUNSET|VEXPORT|VREADONLY|VSTRFIXED|VSTACK)) == 0) {
+		vp->ival = val;
+		vp->flags |= VINT|VINTONLY;
+		return;
+	}
+
+	fmtstr(buf, sizeof(buf), ARITH_FORMAT_STR, val);
+	setvar(name, buf, 0);
+	savevarint(vp, val);
+}
+
+/*
+ * Bring the text of a VINTONLY variable up to date.
+ */
+
+STATIC void
+intvartext(struct var *vp)
+{
+	char *p;
+	int len;
+
+	INTOFF;
+	len = vp->name_len + 1;
+	p = ckmalloc(len + DIGITS(vp->ival) + 1);
+	memcpy(p, vp->text, len);
+	fmtstr(p + len, DIGITS(vp->ival) + 1, ARITH_FORMAT_STR, vp->ival);
+	if ((vp->flags & (VTEXTFIXED|VSTACK)) == 0)
+		ckfree(vp->text);
+	vp->text = p;
+	vp->flags &= ~(VTEXTFIXED|VSTACK|VINTONLY);
+	INTON;
+}
+
+
+
 /*
  * Search the environment of a builtin command.  If the second argument
  * is nonzero, return the value of a variable even if it hasn't been
@@ -595,10 +730,12 @@ bltinlookup(const char *name, int doall)
 			return strchr(sp->text, '=') + 1;
 	}
 
-	v = find_var(name, NULL, NULL);
+	v = find_var(name, NULL);
 
 	if (v == NULL || v->flags & VUNSET || (!doall && !(v->flags & VEXPORT)))
 		return NULL;
+	if (v->flags & VINTONLY)
+		intvartext(v);
 
 	if (v->rfunc && (v->flags & VFUNCREF) != 0) {
 		p = (*v->rfunc)(v);
@@ -620,34 +757,76 @@ bltinlookup(const char *name, int doall)
 char **
 environment(void)
 {
-	int nenv;
-	struct var **vpp;
-	struct var *vp;
+	struct envref *rp;
 	char **env;
 	char **ep;
+	int omit = 0;
+	int i;
 
-	nenv = 0;
-	for (vpp = vartab ; vpp < vartab + VTABSIZE ; vpp++) {
-		for (vp = *vpp ; vp ; vp = vp->next)
-			if ((vp->flags & (VEXPORT|VUNSET)) == VEXPORT)
-				nenv++;
+	INTOFF;
+	if (envdirty)
+		mkenviron();
+	for (rp = envrefs ; rp < &envrefs[nenvrefs] ; rp++) {
+		envvec[rp->slot] = (*rp->vp->rfunc)(rp->vp);
+		if (envvec[rp->slot] == NULL)
+			omit++;
 	}
+	INTON;
+	if (omit == 0)
+		return envvec;
+
+	/* rare: a magic var has no value, return a copy without it */
+	ep = env = stalloc((nenvvec - omit + 1) * sizeof *env);
+	for (i = 0 ; i < nenvvec ; i++)
+		if (envvec[i] != NULL)
+			*ep++ = envvec[i];
+	*ep = NULL;
+	return env;
+}
+
+/*
+ * Rebuild envvec from the exported variables (in varlist order).
+ */
+
+STATIC void
+mkenviron(void)
+{
+	int nenv, nref;
+	struct var *vp;
+	char **ep;
+
+	nenv = nref = 0;
+	for (vp = varlist ; vp ; vp = vp->lnext)
+		if ((vp->flags & (VEXPORT|VUNSET)) == VEXPORT) {
+			nenv++;
+			if (vp->rfunc && (vp->flags & VFUNCREF))
+				nref++;
+		}
 	CTRACE(DBG_VARS, ("environment: %d vars to export\n", nenv));
-	ep = env = stalloc((nenv + 1) * sizeof *env);
-	for (vpp = vartab ; vpp < vartab + VTABSIZE ; vpp++) {
-		for (vp = *vpp ; vp ; vp = vp->next)
-			if ((vp->flags & (VEXPORT|VUNSET)) == VEXPORT) {
-				if (vp->rfunc && (vp->flags & VFUNCREF)) {
-					*ep = (*vp->rfunc)(vp);
-					if (*ep != NULL)
-						ep++;
-				} else
-					*ep++ = vp->text;
-				VTRACE(DBG_VARS, ("environment: %s\n", ep[-1]));
-			}
+
+	if (nenv + 1 > envvecsize) {
+		envvec = ckrealloc(envvec, (nenv + 1) * sizeof *envvec);
+		envvecsize = nenv + 1;
 	}
+	envrefs = ckrealloc(envrefs, (nref + 1) * sizeof *envrefs);
+
+	nenvrefs = 0;
+	ep = envvec;
+	for (vp = varlist ; vp ; vp = vp->lnext)
+		if ((vp->flags & (VEXPORT|VUNSET)) == VEXPORT) {
+			if (vp->rfunc && (vp->flags & VFUNCREF)) {
+				envrefs[nenvrefs].vp = vp;
+				envrefs[nenvrefs].slot = ep - envvec;
+				nenvrefs++;
+			}
+			if (vp->flags & VINTONLY)
+				intvartext(vp);
+			*ep++ = vp->text;
+			VTRACE(DBG_VARS, ("environment: %s\n", ep[-1]));
+		}
 	*ep = NULL;
-	return env;
+	nenvvec = nenv;
+	envdirty = 0;
 }
 
 
@@ -668,26 +847,22 @@ SHELLPROC {
 void
 shprocvar(void)
 {
-	struct var **vpp;
-	struct var *vp, **prev;
-
-	for (vpp = vartab ; vpp < vartab + VTABSIZE ; vpp++) {
-		for (prev = vpp ; (vp = *prev) != NULL ; ) {
-			if ((vp->flags & VEXPORT) == 0) {
-				*prev = vp->next;
-				if ((vp->flags & VTEXTFIXED) == 0)
-					ckfree(vp->text);
-				if ((vp->flags & VSTRFIXED) == 0)
-					ckfree(vp);
-			} else {
-				if (vp->flags & VSTACK) {
-					vp->text = savestr(vp->text);
-					vp->flags &=~ VSTACK;
-				}
-				prev = &vp->next;
-			}
+	struct var *vp, *next;
+
+	for (vp = varlist ; vp != NULL ; vp = next) {
+		next = vp->lnext;
+		if ((vp->flags & VEXPORT) == 0) {
+			delete_var(vp);
+			if ((vp->flags & VTEXTFIXED) == 0)
+				ckfree(vp->text);
+			if ((vp->flags & VSTRFIXED) == 0)
+				ckfree(vp);
+		} else if (vp->flags & VSTACK) {
+			vp->text = savestr(vp->text);
+			vp->flags &=~ VSTACK;
 		}
 	}
+	envdirty = 1;
 	initvar();
 }
 
@@ -776,6 +951,8 @@ showvar(struct var *vp, const char *cmd, const char *xtra, int show_value)
 {
 	const char *p;
 
+	if (vp->flags & VINTONLY)
+		intvartext(vp);
 	p = vp->text;
 	if (vp->rfunc && (vp->flags & VFUNCREF) != 0) {
 		p = (*vp->rfunc)(vp);
@@ -814,19 +991,17 @@ showvars(const char *cmd, int flag, int show_value, const char *xtra)
 		list = ckmalloc(list_len * sizeof *list);
 	}
 
-	for (vpp = vartab ; vpp < vartab + VTABSIZE ; vpp++) {
-		for (vp = *vpp ; vp ; vp = vp->next) {
-			if (flag && !(vp->flags & flag))
-				continue;
-			if (vp->flags & VUNSET && !(show_value & 2))
-				continue;
-			if (count >= list_len) {
-				list = ckrealloc(list,
-					(list_len << 1) * sizeof *list);
-				list_len <<= 1;
-			}
-			list[count++] = vp;
+	for (vp = varlist ; vp ; vp = vp->lnext) {
+		if (flag && !(vp->flags & flag))
+			continue;
+		if (vp->flags & VUNSET && !(show_value & 2))
+			continue;
+		if (count >= list_len) {
+			list = ckrealloc(list,
+				(list_len << 1) * sizeof *list);
+			list_len <<= 1;
 		}
+		list[count++] = vp;
 	}
 
 	qsort(list, count, sizeof *list, sort_var);
@@ -937,7 +1112,7 @@ exportcmd(int argc, char **argv)
 		while ((name = *argptr++) != NULL) {
 			int len;
 
-			vp = find_var(name, NULL, &len);
+			vp = find_var(name, &len);
 			if (name[len] == '=')
 				export_usage(p);
 			if (!goodname(name))
@@ -963,7 +1138,7 @@ exportcmd(int argc, char **argv)
 		while ((name = *argptr++) != NULL) {
 			int len;
 
-			vp = find_var(name, NULL, &len);
+			vp = find_var(name, &len);
 			if (name[len] == '=')
 				export_usage(p);
 			if (!goodname(name))
@@ -981,12 +1156,14 @@ exportcmd(int argc, char **argv)
 
 		f = flag;
 
-		vp = find_var(name, NULL, &len);
+		vp = find_var(name, &len);
 		p = name + len;
 		if (*p++ != '=')
 			p = NULL;
 
 		if (vp != NULL) {
+			if (flag != VREADONLY)
+				envdirty = 1;
 			if (nflg)
 				vp->flags &= ~flag;
 			else if (flag&VEXPORT && vp->flags&VNOEXPORT) {
@@ -1054,7 +1231,6 @@ void
 mklocal(const char *name, int flags)
 {
 	struct localvar *lvp;
-	struct var **vpp;
 	struct var *vp;
 
 	INTOFF;
@@ -1067,7 +1243,7 @@ mklocal(const char *name, int flags)
 		vp = NULL;
 		xtrace_clone(0);
 	} else {
-		vp = find_var(name, &vpp, NULL);
+		vp = find_var(name, NULL);
 		if (vp == NULL) {
 			flags &= ~VNOEXPORT;
 			if (strchr(name, '='))
@@ -1075,14 +1251,18 @@ mklocal(const char *name, int flags)
 				    VSTRFIXED | (flags & ~VUNSET));
 			else
 				setvar(name, NULL, VSTRFIXED|flags);
-			vp = *vpp;	/* the new variable */
+			vp = find_var(name, NULL);	/* the new variable */
 			lvp->text = NULL;
 			lvp->flags = VUNSET;
 			lvp->rfunc = NULL;
 		} else {
+			if (vp->flags & VINTONLY)
+				intvartext(vp);
 			lvp->text = vp->text;
-			lvp->flags = vp->flags;
+			lvp->flags = vp->flags & ~VINT;	/* ival is not saved */
 			lvp->v_u = vp->v_u;
+			if ((vp->flags | flags) & VEXPORT)
+				envdirty = 1;
 			vp->flags |= VSTRFIXED|VTEXTFIXED;
 			if (flags & (VDOEXPORT | VUNSET))
 				vp->flags &= ~VNOEXPORT;
@@ -1114,6 +1294,34 @@ mklocal(const char *name, int flags)
 }
 
 
+/*
+ * While forcelocal is set, every variable assigned is first made local
+ * (once) so poplocalvars() can put things back the way they were.
+ */
+
+STATIC void
+localise(const char *name, int len)
+{
+	struct localvar *lvp;
+	char *p;
+
+	for (lvp = localvars; lvp != NULL; lvp = lvp->next)
+		if (lvp->vp != NULL && lvp->vp->name_len == len &&
+		    memcmp(lvp->vp->text, name, len) == 0)
+			return;
+
+	INTOFF;
+	p = ckmalloc(len + 1);
+	memcpy(p, name, len);
+	p[len] = '\0';
+	forcelocal--;		/* mklocal() may create the var */
+	mklocal(p, 0);
+	forcelocal++;
+	ckfree(p);
+	INTON;
+}
+
+
 /*
  * Called after a function returns.
  */
@@ -1140,6 +1348,8 @@ poplocalvars(void)
 				(*lvp->func)(lvp->text + vp->name_len + 1);
 			if ((vp->flags & VTEXTFIXED) == 0)
 				ckfree(vp->text);
+			if ((vp->flags | lvp->flags) & VEXPORT)
+				envdirty = 1;
 			vp->flags = lvp->flags;
 			vp->text = lvp->text;
 			vp->v_u = lvp->v_u;
@@ -1213,10 +1423,9 @@ unsetcmd(int argc, char **argv)
 int
 unsetvar(const char *s, int unexport)
 {
-	struct var **vpp;
 	struct var *vp;
 
-	vp = find_var(s, &vpp, NULL);
+	vp = find_var(s, NULL);
 	if (vp == NULL)
 		return 0;
 
@@ -1224,18 +1433,20 @@ unsetvar(const char *s, int unexport)
 		return 1;
 
 	INTOFF;
+	if (vp->flags & VEXPORT)
+		envdirty = 1;
 	if (unexport & 1) {
 		vp->flags &= ~VEXPORT;
 	} else {
-		if (vp->text[vp->name_len + 1] != '\0')
+		if (vp->flags & VINTONLY || vp->text[vp->name_len + 1] != '\0')
 			setvar(s, nullstr, 0);
 		if (!(unexport & 2))
 			vp->flags &= ~VEXPORT;
 		vp->flags |= VUNSET;
 		if ((vp->flags&(VEXPORT|VSTRFIXED|VREADONLY|VNOEXPORT)) == 0) {
+			delete_var(vp);
 			if ((vp->flags & VTEXTFIXED) == 0)
 				ckfree(vp->text);
-			*vpp = vp->next;
 			ckfree(vp);
 		}
 	}
@@ -1265,42 +1476,132 @@ strequal(const char *p, const char *q)
 /*
  * Search for a variable.
  * 'name' may be terminated by '=' or a NUL.
- * vppp is set to the pointer to vp, or the list head if vp isn't found
  * lenp is set to the number of characters in 'name'
  */
 
 STATIC struct var *
-find_var(const char *name, struct var ***vppp, int *lenp)
+find_var(const char *name, int *lenp)
 {
 	unsigned int hashval;
 	int len;
-	struct var *vp, **vpp;
-	const char *p = name;
-
-	hashval = 0;
-	while (*p && *p != '=')
-		hashval = 2 * hashval + (unsigned char)*p++;
+	struct var *vp;
 
-	len = p - name;
+	hashval = strhash(name, '=', &len);
 	if (lenp)
 		*lenp = len;
 
-	vpp = &vartab[hashval % VTABSIZE];
-	if (vppp)
-		*vppp = vpp;
-
-	for (vp = *vpp ; vp ; vpp = &vp->next, vp = *vpp) {
-		if (vp->name_len != len)
+	for (vp = vartab[hashval & (vartabsize - 1)]; vp; vp = vp->next) {
+		if (vp->hash != hashval || vp->name_len != len)
 			continue;
 		if (memcmp(vp->text, name, len) != 0)
 			continue;
-		if (vppp)
-			*vppp = vpp;
 		return vp;
 	}
 	return NULL;
 }
 
+/*
+ * Search for a variable, for those who want to keep the struct var
+ * (and look at it with lookupvp()) rather than looking it up by name
+ * each time.  Such a pointer may be kept for only as long as vargen
+ * does not change.
+ */
+
+struct var *
+findvar(const char *name)
+{
+
+	return find_var(name, NULL);
+}
+
+/*
+ * Enter a new variable (which must not already exist) into vartab,
+ * and at the end of varlist.  vp->text must be set.
+ */
+
+STATIC void
+add_var(struct var *vp)
+{
+	struct var **vpp;
+
+	INTOFF;
+	if (nvars >= vartabsize)
+		grow_vartab();
+	vp->hash = strhash(vp->text, '=', &vp->name_len);
+	vpp = &vartab[vp->hash & (vartabsize - 1)];
+	vp->next = *vpp;
+	*vpp = vp;
+	nvars++;
+
+	vp->lnext = NULL;
+	vp->lprev = varlast;
+	*varlast = vp;
+	varlast = &vp->lnext;
+	if (vp->flags & VEXPORT)
+		envdirty = 1;
+	INTON;
+}
+
+/*
+ * Remove a variable from vartab and varlist (the caller frees it).
+ */
+
+STATIC void
+delete_var(struct var *vp)
+{
+	struct var **vpp;
+
+	INTOFF;
+	for (vpp = &vartab[vp->hash & (vartabsize - 1)]; *vpp != vp;
+	    vpp = &(*vpp)->next)
+		;
+	*vpp = vp->next;
+	nvars--;
+	vargen++;
+
+	*vp->lprev = vp->lnext;
+	if (vp->lnext != NULL)
+		vp->lnext->lprev = vp->lprev;
+	else
+		varlast = vp->lprev;
+	if (vp->flags & VEXPORT)
+		envdirty = 1;
+	INTON;
+}
+
+/*
+ * Double the size of the hash table.  If we cannot get the memory, we
+ * just keep using the table we have, with longer chains.
+ */
+
+STATIC void
+grow_vartab(void)
+{
+	struct var **ntab;
+	struct var *vp, *next;
+	unsigned int nsize = vartabsize << 1;
+	unsigned int i;
+
+	/* not ckmalloc() - we want failure, not error() here */
+	ntab = calloc(nsize, sizeof *ntab);
+	if (ntab == NULL)
+		return;
+
+	for (i = 0; i < vartabsize; i++) {
+		for (vp = vartab[i]; vp != NULL; vp = next) {
+			next = vp->next;
+			vp->next = ntab[vp->hash & (nsize - 1)];
+			ntab[vp->hash & (nsize - 1)] = vp;
+		}
+	}
+	if (vartab != vartab_init)
+		free(vartab);
+	vartab = ntab;
+	vartabsize = nsize;
+	VTRACE(DBG_VARS, ("grow_vartab: %u buckets for %u vars\n",
+	    vartabsize, nvars));
+}
+
 /*
  * The following are the functions that create the values for
  * shell variables that are dynamically produced when needed.
@@ -1553,6 +1854,8 @@ makespecial(const char *name)
 				return 1;
 			}
 			INTOFF;
+			if (vp->flags & VEXPORT)
+				envdirty = 1;
 			vp->flags &= ~VUNSET;
 			vp->v_u = ip->v_u;
 			INTON;
@@ -48,8 +48,10 @@
 #define VSTRFIXED	0x0010	/* variable struct is statically allocated */
 #define VTEXTFIXED	0x0020	/* text is statically allocated */
 #define VSTACK		0x0040	/* text is allocated on the stack */
+#define VINT		0x0080	/* ival holds the (integer) value */
 #define VNOFUNC		0x0100	/* don't call the callback function */
 #define VFUNCREF	0x0200	/* the function is called on ref, not set */
+#define VINTONLY	0x0400	/* the value in text is out of date */
 
 #define VSPECIAL	0x1000	/* magic properties not lost when set */
 #define VDOEXPORT	0x2000	/* obey VEXPORT even if VNOEXPORT */
@@ -65,10 +67,14 @@ union var_func_union {		/* function to be called when:  */
 
 struct var {
 	struct var *next;		/* next entry in hash list */
+	struct var *lnext;		/* next var in order of creation */
+	struct var **lprev;		/* link to this var in that list */
 	int flags;			/* flags are defined above */
 	char *text;			/* name=value */
 	int name_len;			/* length of name */
+	unsigned int hash;		/* hash of name */
 	union var_func_union v_u;	/* function to apply (sometimes) */
+	intmax_t ival;			/* value, if VINT */
 };
 
 
@@ -82,6 +88,7 @@ struct localvar {
 
 
 extern struct localvar *localvars;
+extern int forcelocal;
 
 extern struct var vifs;
 extern char ifs_default[];
@@ -103,6 +110,8 @@ extern struct var random_num;
 extern intmax_t sh_start_time;
 #endif
 
+extern unsigned int vargen;
+
 extern int line_number;
 extern int funclinebase;
 extern int funclineabs;
@@ -135,6 +144,11 @@ void setvareq(char *, int);
 struct strlist;
 void listsetvar(struct strlist *, int);
 char *lookupvar(const char *);
+struct var *findvar(const char *);
+char *lookupvp(struct var *);
+int lookupvarint(struct var *, intmax_t *);
+void savevarint(struct var *, intmax_t);
+void setvarint(const char *, struct var *, intmax_t);
 char *bltinlookup(const char *, int);
 char **environment(void);
 void shprocvar(void);